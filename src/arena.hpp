@@ -0,0 +1,100 @@
+//
+//  arena.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef arena_h
+#define arena_h
+#include <stdio.h>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+
+// Bump allocator for the memory buffer. Allocations are carved out of large
+// blocks and never freed individually; everything goes at once when the arena
+// is destroyed, which is exactly the lifetime of a buffer run. Not thread safe.
+class Arena {
+public:
+    static const size_t MIN_BLOCK = 4096;
+    static const size_t MAX_BLOCK = 1 << 20;
+
+    Arena(): _cur(NULL), _end(NULL), _nextBlock(MIN_BLOCK), _bytesUsed(0) {}
+
+    ~Arena() {
+        for (size_t i = 0; i < _blocks.size(); ++i) {
+            free(_blocks[i]);
+        }
+    }
+
+    void * allocate(size_t bytes, size_t align = alignof(void *)) {
+        uintptr_t p = ((uintptr_t) _cur + align - 1) & ~(uintptr_t) (align - 1);
+        if (_cur == NULL || p + bytes > (uintptr_t) _end) {
+            newBlock(bytes + align);
+            p = ((uintptr_t) _cur + align - 1) & ~(uintptr_t) (align - 1);
+        }
+        _cur = (char *) (p + bytes);
+        _bytesUsed += bytes;
+        return (void *) p;
+    }
+
+    size_t bytes_used() {
+        return _bytesUsed;
+    }
+
+    size_t bytes_reserved() {
+        size_t total = 0;
+        for (size_t i = 0; i < _blockSizes.size(); ++i) {
+            total += _blockSizes[i];
+        }
+        return total;
+    }
+
+private:
+    char *_cur;
+    char *_end;
+    size_t _nextBlock;
+    size_t _bytesUsed;
+    vector<char *> _blocks;
+    vector<size_t> _blockSizes;
+
+    void newBlock(size_t minBytes) {
+        // blocks double up to MAX_BLOCK so small runs stay small and big runs make few mallocs
+        size_t size = _nextBlock;
+        while (size < minBytes) {
+            size *= 2;
+        }
+        if (_nextBlock < MAX_BLOCK) {
+            _nextBlock *= 2;
+        }
+        char *block = (char *) malloc(size);
+        if (block == NULL) {
+            perror("Error allocating arena block");
+            exit(EXIT_FAILURE);
+        }
+        _blocks.push_back(block);
+        _blockSizes.push_back(size);
+        _cur = block;
+        _end = block + size;
+    }
+};
+
+#endif /* arena_h */
@@ -0,0 +1,592 @@
+//
+//  bench.cpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  YCSB-style workload driver: `make bench`, then
+//
+//      ./bench.out workload=a records=1000000 operations=1000000 threads=4
+//      ./bench.out spec=my.workload format=json
+//
+//  A workload is a list of key=value settings, given on the command line or
+//  in a spec file (one per line, # starts a comment); later ones win. The
+//  load phase inserts `records` keys, then the run phase issues `operations`
+//  operations drawn from the mix. Everything random comes from `seed`, so the
+//  same spec issues the same operations on every run (per thread; with several
+//  threads the interleaving is up to the scheduler).
+//
+//  Each phase ends by waiting for the merges it left behind; merge_wait_s is
+//  that wait, so seconds + merge_wait_s is the phase's time including its
+//  merges. Sweeping the merge settings one at a time shows how merges scale:
+//
+//      for t in 0 1 2 4; do ./bench.out workload=a compaction_threads=$t; done
+//      for s in 1 2 4 8; do ./bench.out workload=a subcompactions=$s; done
+//      for b in 1 2 4 8; do ./bench.out workload=a max_flush_batches=$b; done
+//
+//  read_path=multi_get issues the run phase's reads read_batch at a time
+//  through LSM::multi_get instead of one lookup each; a batched read's
+//  latency is its batch's time split evenly over its keys. filter=blocked
+//  gives the disk runs BlockedBloomFilters instead of BloomFilters.
+//  read_path=interleaved batches them the same way through
+//  LSM::interleaved_get, interleave_width lookups in flight, and needs
+//  `make bench CXXSTD=c++20`.
+//
+//  run_backend=pread reads disk runs through a block cache of
+//  block_cache_bytes instead of through their mappings, and adds each phase's
+//  cache hit rate to the report.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <cmath>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <thread>
+#include <atomic>
+#include "lsm.hpp"
+
+using namespace std;
+
+struct WorkloadSpec {
+    unsigned long records = 1000000;
+    unsigned long operations = 1000000;
+    double read = 0.5;          // operation mix, normalized to sum to 1
+    double update = 0.5;
+    double insert = 0;
+    double scan = 0;
+    double rmw = 0;             // read-modify-write
+    string distribution = "zipfian"; // uniform, zipfian, latest or sequential
+    double zipfTheta = 0.99;
+    unsigned maxScan = 100;     // scans read 1..maxScan pairs
+    unsigned threads = 1;
+    unsigned valueSize = 4;     // bytes; the tree's values are integers, so 4 or 8
+    unsigned long seed = 42;
+    string format = "csv";      // csv or json
+    string readPath = "lookup"; // lookup, multi_get or interleaved
+    unsigned readBatch = 64;    // reads per multi_get or interleaved_get
+    unsigned interleaveWidth = 16;
+
+    // tree shape, as for LSM's constructor
+    unsigned long eltsPerRun = 800;
+    unsigned bufferRuns = 20;
+    double mergeFrac = 1.0;
+    double bfFp = 0.001;
+    unsigned pageSize = 512;
+    unsigned diskRunsPerLevel = 20;
+    string filter = "bloom";    // bloom or blocked
+    string runBackend = "mmap"; // mmap or pread
+    size_t blockCacheBytes = 64 << 20;
+    string mergePolicy = "tiering"; // tiering, leveling or lazy
+    unsigned compactionThreads = 2;
+    unsigned subcompactions = 1;
+    unsigned maxFlushBatches = 2;
+};
+
+static void usage(const string &why){
+    cerr << "bench: " << why << endl;
+    cerr << "usage: bench.out [spec=FILE] [workload=a-f] [key=value ...]" << endl;
+    exit(EXIT_FAILURE);
+}
+
+// the core YCSB workloads
+static void presetWorkload(WorkloadSpec &w, const string &name){
+    w.read = w.update = w.insert = w.scan = w.rmw = 0;
+    w.distribution = "zipfian";
+    if (name == "a") { w.read = 0.5; w.update = 0.5; }
+    else if (name == "b") { w.read = 0.95; w.update = 0.05; }
+    else if (name == "c") { w.read = 1; }
+    else if (name == "d") { w.read = 0.95; w.insert = 0.05; w.distribution = "latest"; }
+    else if (name == "e") { w.scan = 0.95; w.insert = 0.05; }
+    else if (name == "f") { w.read = 0.5; w.rmw = 0.5; }
+    else usage("unknown workload " + name);
+}
+
+static void loadSpecFile(WorkloadSpec &w, const string &path);
+
+static void setField(WorkloadSpec &w, const string &key, const string &value){
+    if (key == "spec") loadSpecFile(w, value);
+    else if (key == "workload") presetWorkload(w, value);
+    else if (key == "records") w.records = stoul(value);
+    else if (key == "operations") w.operations = stoul(value);
+    else if (key == "read") w.read = stod(value);
+    else if (key == "update") w.update = stod(value);
+    else if (key == "insert") w.insert = stod(value);
+    else if (key == "scan") w.scan = stod(value);
+    else if (key == "rmw") w.rmw = stod(value);
+    else if (key == "distribution") w.distribution = value;
+    else if (key == "zipf_theta") w.zipfTheta = stod(value);
+    else if (key == "max_scan") w.maxScan = stoul(value);
+    else if (key == "threads") w.threads = stoul(value);
+    else if (key == "value_size") w.valueSize = stoul(value);
+    else if (key == "seed") w.seed = stoul(value);
+    else if (key == "format") w.format = value;
+    else if (key == "read_path") w.readPath = value;
+    else if (key == "read_batch") w.readBatch = stoul(value);
+    else if (key == "interleave_width") w.interleaveWidth = stoul(value);
+    else if (key == "elts_per_run") w.eltsPerRun = stoul(value);
+    else if (key == "buffer_runs") w.bufferRuns = stoul(value);
+    else if (key == "merge_frac") w.mergeFrac = stod(value);
+    else if (key == "bf_fp") w.bfFp = stod(value);
+    else if (key == "page_size") w.pageSize = stoul(value);
+    else if (key == "disk_runs_per_level") w.diskRunsPerLevel = stoul(value);
+    else if (key == "filter") w.filter = value;
+    else if (key == "run_backend") w.runBackend = value;
+    else if (key == "block_cache_bytes") w.blockCacheBytes = stoul(value);
+    else if (key == "merge_policy") w.mergePolicy = value;
+    else if (key == "compaction_threads") w.compactionThreads = stoul(value);
+    else if (key == "subcompactions") w.subcompactions = stoul(value);
+    else if (key == "max_flush_batches") w.maxFlushBatches = stoul(value);
+    else usage("unknown setting " + key);
+}
+
+static void setPair(WorkloadSpec &w, const string &kv){
+    size_t eq = kv.find('=');
+    if (eq == string::npos) {
+        usage("expected key=value, got " + kv);
+    }
+    setField(w, kv.substr(0, eq), kv.substr(eq + 1));
+}
+
+static void loadSpecFile(WorkloadSpec &w, const string &path){
+    ifstream in(path);
+    if (!in) {
+        perror(("Error opening workload spec " + path).c_str());
+        exit(EXIT_FAILURE);
+    }
+    string line;
+    while (getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        string kv;
+        while (words >> kv) {
+            setPair(w, kv);
+        }
+    }
+}
+
+// YCSB's zipfian generator (Gray et al., "Quickly generating billion-record
+// synthetic databases"): item 0 is the most popular. zeta(n) is computed once,
+// up front, and shared by every thread's generator.
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(unsigned long items, double theta): _items(items), _theta(theta) {
+        double zeta2 = 0;
+        _zetan = 0;
+        for (unsigned long i = 1; i <= items; i++) {
+            _zetan += 1 / pow((double) i, theta);
+            if (i == 2) zeta2 = _zetan;
+        }
+        _alpha = 1 / (1 - theta);
+        _eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / _zetan);
+    }
+
+    unsigned long next(double u) const {
+        double uz = u * _zetan;
+        if (uz < 1) return 0;
+        if (uz < 1 + pow(0.5, _theta)) return 1;
+        unsigned long v = (unsigned long) (_items * pow(_eta * u - _eta + 1, _alpha));
+        return v >= _items ? _items - 1 : v;
+    }
+
+private:
+    unsigned long _items;
+    double _theta, _zetan, _alpha, _eta;
+};
+
+// Record i is stored under a scrambled key, so that popular and recent
+// records are spread over the key space as in YCSB. Multiplying by an odd
+// constant is a bijection on 30-bit numbers, and 30 bits keep clear of the
+// INT_MIN/INT_MAX sentinels.
+static int recordKey(unsigned long i){
+    return (int) ((i * 2654435761ul) & 0x3fffffff);
+}
+
+enum Op { READ, UPDATE, INSERT, SCAN, RMW, NUM_OPS };
+static const char *opNames[] = {"read", "update", "insert", "scan", "rmw"};
+
+struct ThreadResult {
+    Histogram latency[NUM_OPS];
+    unsigned long found = 0;
+};
+
+struct PhaseResult {
+    string name;
+    double seconds;
+    double mergeWait; // seconds the phase's leftover merges took to finish
+    uint64_t stalls; // writes that waited on merges
+    double cacheHitRate; // of block cache lookups; -1 without a cache
+    Histogram latency[NUM_OPS];
+    unsigned long found;
+    double writeAmplification; // of this phase's writes
+    unsigned long diskBytes;
+    unsigned long records; // records inserted so far
+};
+
+template <class V, class RunType, class FilterType>
+class Benchmark {
+public:
+    typedef LSM<int, V, RunType, FilterType> Tree;
+
+    Benchmark(const WorkloadSpec &w): _w(w), _inserted(0), _sequential(0), _zipf(NULL) {
+        LSMOptions options;
+        options.metrics = true; // write amplification and stalls come from the tree's counters
+        options.compactionThreads = w.compactionThreads;
+        options.subcompactions = w.subcompactions;
+        options.maxFlushBatches = w.maxFlushBatches;
+        if (w.runBackend == "pread") options.runBackend = PREAD_RUNS;
+        else if (w.runBackend != "mmap") usage("unknown run_backend " + w.runBackend);
+        options.blockCacheBytes = w.blockCacheBytes;
+        if (w.mergePolicy == "leveling") options.mergePolicy = LEVELING;
+        else if (w.mergePolicy == "lazy") options.mergePolicy = LAZY_LEVELING;
+        else if (w.mergePolicy != "tiering") usage("unknown merge_policy " + w.mergePolicy);
+        _tree = new Tree(w.eltsPerRun, w.bufferRuns, w.mergeFrac, w.bfFp, w.pageSize, w.diskRunsPerLevel, options);
+        if (w.distribution == "zipfian" || w.distribution == "latest") {
+            _zipf = new ZipfianGenerator(max(w.records, 2ul), w.zipfTheta);
+        }
+        else if (w.distribution != "uniform" && w.distribution != "sequential") {
+            usage("unknown distribution " + w.distribution);
+        }
+        double total = w.read + w.update + w.insert + w.scan + w.rmw;
+        if (total <= 0) {
+            usage("the operation mix is empty");
+        }
+        double mix[NUM_OPS] = {w.read, w.update, w.insert, w.scan, w.rmw};
+        double acc = 0;
+        for (int i = 0; i < NUM_OPS; i++) {
+            acc += mix[i] / total;
+            _cumulative[i] = acc;
+        }
+    }
+
+    ~Benchmark(){
+        delete _tree;
+        delete _zipf;
+    }
+
+    vector<PhaseResult> run(){
+        vector<PhaseResult> phases;
+        phases.push_back(phase("load", _w.records, true));
+        phases.push_back(phase("run", _w.operations, false));
+        return phases;
+    }
+
+private:
+    const WorkloadSpec &_w;
+    Tree *_tree;
+    atomic<unsigned long> _inserted; // records loaded or inserted so far
+    atomic<unsigned long> _sequential;
+    ZipfianGenerator *_zipf;
+    double _cumulative[NUM_OPS];
+    MetricsSnapshot _before; // the tree's counters when the phase started
+
+    PhaseResult phase(const string &name, unsigned long ops, bool load){
+        vector<ThreadResult> results(_w.threads);
+        vector<thread> threads;
+        _sequential = 0;
+        _before = _tree->metrics()->snapshot();
+        BlockCache *cache = _tree->blockCache();
+        uint64_t hitsBefore = cache ? cache->hits() : 0, missesBefore = cache ? cache->misses() : 0;
+        auto started = chrono::steady_clock::now();
+        for (unsigned t = 0; t < _w.threads; t++) {
+            unsigned long share = ops / _w.threads + (t < ops % _w.threads ? 1 : 0);
+            threads.push_back(thread([this, t, share, load, &results]{
+                mt19937_64 rng(_w.seed * 1000003 + t * 7919 + (load ? 0 : 1));
+                if (load) loadRecords(share, results[t]);
+                else runOps(rng, share, results[t]);
+            }));
+        }
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+        auto opsDone = chrono::steady_clock::now();
+        _tree->waitForMerges(); // charge the phase's merges to its write amplification
+
+        PhaseResult r;
+        r.name = name;
+        r.seconds = chrono::duration<double>(opsDone - started).count();
+        r.mergeWait = chrono::duration<double>(chrono::steady_clock::now() - opsDone).count();
+        r.found = 0;
+        for (unsigned t = 0; t < _w.threads; t++) {
+            for (int op = 0; op < NUM_OPS; op++) {
+                r.latency[op].merge(results[t].latency[op]);
+            }
+            r.found += results[t].found;
+        }
+        MetricsSnapshot after = _tree->metrics()->snapshot();
+        uint64_t written = after.counters[Metrics::BYTES_FLUSHED] + after.counters[Metrics::BYTES_COMPACTED] - _before.counters[Metrics::BYTES_FLUSHED] - _before.counters[Metrics::BYTES_COMPACTED];
+        uint64_t inserted = after.counters[Metrics::BYTES_INSERTED] - _before.counters[Metrics::BYTES_INSERTED];
+        r.writeAmplification = inserted == 0 ? 0 : (double) written / inserted;
+        r.stalls = after.counters[Metrics::STALLS] - _before.counters[Metrics::STALLS];
+        r.cacheHitRate = -1;
+        if (cache) {
+            uint64_t hits = cache->hits() - hitsBefore, misses = cache->misses() - missesBefore;
+            r.cacheHitRate = hits + misses == 0 ? 0 : (double) hits / (hits + misses);
+        }
+        r.diskBytes = 0;
+        for (size_t i = 0; i < _tree->diskLevels.size(); i++) {
+            r.diskBytes += _tree->diskLevels[i]->num_elements() * sizeof(KVPair<int, V>);
+        }
+        r.records = _inserted;
+        return r;
+    }
+
+    void loadRecords(unsigned long n, ThreadResult &result){
+        for (unsigned long i = 0; i < n; i++) {
+            timed(INSERT, result, [&]{ insertNew(); });
+        }
+    }
+
+    void runOps(mt19937_64 &rng, unsigned long n, ThreadResult &result){
+        uniform_real_distribution<double> unit(0, 1);
+        vector<int> batch; // reads waiting for the next multi_get
+        for (unsigned long i = 0; i < n; i++) {
+            double u = unit(rng);
+            int op = 0;
+            while (op < NUM_OPS - 1 && u >= _cumulative[op]) op++;
+            switch (op) {
+                case READ:
+                    if (_w.readPath != "lookup") {
+                        batch.push_back(recordKey(chooseRecord(rng)));
+                        if (batch.size() == _w.readBatch) {
+                            batchedReads(batch, result);
+                        }
+                        break;
+                    }
+                    timed(op, result, [&]{
+                        int key = recordKey(chooseRecord(rng));
+                        V value;
+                        result.found += _tree->lookup(key, value);
+                    });
+                    break;
+                case UPDATE:
+                    timed(op, result, [&]{
+                        int key = recordKey(chooseRecord(rng));
+                        V value = (V) rng();
+                        _tree->insert_key(key, value);
+                    });
+                    break;
+                case INSERT:
+                    timed(op, result, [&]{ insertNew(); });
+                    break;
+                case SCAN:
+                    timed(op, result, [&]{
+                        int key = recordKey(chooseRecord(rng));
+                        unsigned len = 1 + rng() % _w.maxScan;
+                        auto it = _tree->get_iterator();
+                        it.Seek(key);
+                        for (unsigned j = 0; j < len && it.Valid(); j++) {
+                            it.Next();
+                        }
+                    });
+                    break;
+                case RMW:
+                    timed(op, result, [&]{
+                        int key = recordKey(chooseRecord(rng));
+                        V value;
+                        result.found += _tree->lookup(key, value);
+                        value = value + 1;
+                        _tree->insert_key(key, value);
+                    });
+                    break;
+            }
+        }
+        if (!batch.empty()) {
+            batchedReads(batch, result);
+        }
+    }
+
+    void batchedReads(vector<int> &keys, ThreadResult &result){
+        vector<V> values(keys.size());
+        bool *found = new bool[keys.size()];
+        auto started = chrono::steady_clock::now();
+#ifdef LSM_COROUTINES
+        if (_w.readPath == "interleaved") {
+            _tree->interleaved_get(keys.data(), keys.size(), values.data(), found, _w.interleaveWidth);
+        }
+        else
+#endif
+        _tree->multi_get(keys.data(), keys.size(), values.data(), found);
+        uint64_t each = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count() / keys.size();
+        for (size_t i = 0; i < keys.size(); i++) {
+            result.latency[READ].record(each);
+            result.found += found[i];
+        }
+        delete [] found;
+        keys.clear();
+    }
+
+    template <class F>
+    void timed(int op, ThreadResult &result, F f){
+        auto started = chrono::steady_clock::now();
+        f();
+        result.latency[op].record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+    }
+
+    void insertNew(){
+        unsigned long i = _inserted.fetch_add(1);
+        int key = recordKey(i);
+        V value = (V) i;
+        _tree->insert_key(key, value);
+    }
+
+    // a record that has been inserted, drawn from the distribution
+    unsigned long chooseRecord(mt19937_64 &rng){
+        unsigned long n = max(_inserted.load(memory_order_relaxed), 1ul);
+        if (_w.distribution == "uniform") {
+            return rng() % n;
+        }
+        if (_w.distribution == "sequential") {
+            return _sequential.fetch_add(1, memory_order_relaxed) % n;
+        }
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        unsigned long z = _zipf->next(u);
+        if (_w.distribution == "latest") {
+            return z < n ? n - 1 - z : n - 1; // the most recent is the most popular
+        }
+        return z % n; // popular records are scattered by recordKey
+    }
+};
+
+static void report(const WorkloadSpec &w, const vector<PhaseResult> &phases, size_t pairBytes){
+    bool json = w.format == "json";
+    if (json) {
+        cout << "{\"workload\":{\"records\":" << w.records << ",\"operations\":" << w.operations << ",\"read\":" << w.read
+             << ",\"update\":" << w.update << ",\"insert\":" << w.insert << ",\"scan\":" << w.scan << ",\"rmw\":" << w.rmw
+             << ",\"distribution\":\"" << w.distribution << "\",\"threads\":" << w.threads << ",\"value_size\":" << w.valueSize
+             << ",\"seed\":" << w.seed << ",\"read_path\":\"" << w.readPath << "\",\"read_batch\":" << w.readBatch << ",\"interleave_width\":" << w.interleaveWidth
+             << ",\"filter\":\"" << w.filter << "\",\"run_backend\":\"" << w.runBackend << "\",\"block_cache_bytes\":" << w.blockCacheBytes
+             << ",\"merge_policy\":\"" << w.mergePolicy << "\",\"compaction_threads\":" << w.compactionThreads
+             << ",\"subcompactions\":" << w.subcompactions << ",\"max_flush_batches\":" << w.maxFlushBatches << "},\"phases\":[";
+    }
+    else {
+        cout << "phase,operation,count,ops_per_sec,mean_us,p50_us,p99_us,p999_us,max_us,write_amplification,disk_bytes,space_amplification,merge_wait_s,stalls,cache_hit_rate" << endl;
+    }
+    for (size_t p = 0; p < phases.size(); p++) {
+        const PhaseResult &r = phases[p];
+        unsigned long total = 0;
+        for (int op = 0; op < NUM_OPS; op++) {
+            total += r.latency[op].count();
+        }
+        double space = r.records == 0 ? 0 : (double) r.diskBytes / (r.records * pairBytes);
+        if (json) {
+            cout << (p ? "," : "") << "{\"phase\":\"" << r.name << "\",\"seconds\":" << r.seconds << ",\"merge_wait_s\":" << r.mergeWait
+                 << ",\"stalls\":" << r.stalls;
+            if (r.cacheHitRate >= 0) {
+                cout << ",\"cache_hit_rate\":" << r.cacheHitRate;
+            }
+            cout << ",\"ops_per_sec\":" << total / r.seconds
+                 << ",\"write_amplification\":" << r.writeAmplification << ",\"disk_bytes\":" << r.diskBytes
+                 << ",\"space_amplification\":" << space << ",\"operations\":{";
+        }
+        bool first = true;
+        for (int op = 0; op < NUM_OPS; op++) {
+            const Histogram &h = r.latency[op];
+            if (h.count() == 0) {
+                continue;
+            }
+            if (json) {
+                cout << (first ? "" : ",") << "\"" << opNames[op] << "\":{\"count\":" << h.count() << ",\"ops_per_sec\":" << h.count() / r.seconds
+                     << ",\"mean_us\":" << h.mean() / 1000 << ",\"p50_us\":" << h.percentile(0.5) / 1000.0 << ",\"p99_us\":" << h.percentile(0.99) / 1000.0
+                     << ",\"p999_us\":" << h.percentile(0.999) / 1000.0 << ",\"max_us\":" << h.maxValue() / 1000.0 << "}";
+            }
+            else {
+                cout << r.name << "," << opNames[op] << "," << h.count() << "," << h.count() / r.seconds << "," << h.mean() / 1000 << ","
+                     << h.percentile(0.5) / 1000.0 << "," << h.percentile(0.99) / 1000.0 << "," << h.percentile(0.999) / 1000.0 << ","
+                     << h.maxValue() / 1000.0 << "," << r.writeAmplification << "," << r.diskBytes << "," << space << ","
+                     << r.mergeWait << "," << r.stalls << ",";
+                if (r.cacheHitRate >= 0) {
+                    cout << r.cacheHitRate;
+                }
+                cout << endl;
+            }
+            first = false;
+        }
+        if (json) {
+            cout << "}}";
+        }
+    }
+    if (json) {
+        cout << "]}" << endl;
+    }
+}
+
+template <class V, class FilterType>
+static void runWith(const WorkloadSpec &w){
+    vector<PhaseResult> phases;
+    if (w.threads > 1) {
+        Benchmark<V, ConcurrentSkipList<int, V>, FilterType> b(w);
+        phases = b.run();
+    }
+    else {
+        Benchmark<V, SkipList<int, V>, FilterType> b(w);
+        phases = b.run();
+    }
+    report(w, phases, sizeof(KVPair<int, V>));
+}
+
+template <class V>
+static void runWith(const WorkloadSpec &w){
+    if (w.filter == "bloom") {
+        runWith<V, BloomFilter<int>>(w);
+    }
+    else if (w.filter == "blocked") {
+        runWith<V, BlockedBloomFilter<int>>(w);
+    }
+    else {
+        usage("unknown filter " + w.filter);
+    }
+}
+
+int main(int argc, char *argv[]){
+    WorkloadSpec w;
+    for (int i = 1; i < argc; i++) {
+        setPair(w, argv[i]);
+    }
+    if (w.threads == 0) {
+        usage("threads must be at least 1");
+    }
+    if (w.format != "csv" && w.format != "json") {
+        usage("unknown format " + w.format);
+    }
+    if (w.readPath == "interleaved") {
+#ifndef LSM_COROUTINES
+        usage("read_path=interleaved needs a C++20 build: make bench CXXSTD=c++20");
+#endif
+    }
+    else if (w.readPath != "lookup" && w.readPath != "multi_get") {
+        usage("unknown read_path " + w.readPath);
+    }
+    if (w.readBatch == 0 || w.interleaveWidth == 0) {
+        usage("read_batch and interleave_width must be at least 1");
+    }
+    if (w.valueSize == 4) {
+        runWith<int>(w);
+    }
+    else if (w.valueSize == 8) {
+        runWith<long>(w);
+    }
+    else {
+        usage("value_size must be 4 or 8");
+    }
+    return 0;
+}
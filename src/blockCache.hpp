@@ -0,0 +1,247 @@
+//
+//  blockCache.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef blockCache_h
+#define blockCache_h
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <unistd.h>
+
+using namespace std;
+
+// Pages of disk runs read with pread, for trees built with
+// LSMOptions::runBackend = PREAD_RUNS. A page is a run's fence pointer's
+// worth of pairs and is keyed by the run's file id (see newFileID) and its
+// page number. The cache never holds more than its capacity in page bytes;
+// a page bigger than its shard's share of the capacity is read for the one
+// lookup and not cached.
+//
+// Eviction is 2Q (Johnson and Shasha, VLDB '94). A page read for the first
+// time goes into a FIFO, A1in, of a quarter of the capacity; pages pushed out
+// of it leave their key in a ghost queue, A1out. A page read again while its
+// key is in A1out has now been wanted twice some time apart and goes into an
+// LRU list, Am, which gets the rest of the capacity. A stream of pages read
+// once, as a big scan of cold keys would make, only ever cycles through A1in
+// and never pushes the hot pages out of Am.
+//
+// Pages are spread over SHARDS independently locked caches by key.
+class BlockCache {
+public:
+    // bytes O_DIRECT reads are aligned to (offset, length and buffer); the
+    // logical block size of any file system this runs on divides it
+    static const size_t DIRECT_ALIGN = 4096;
+
+    BlockCache(size_t capacity): _capacity(capacity), _nextFileID(0) {
+        for (int s = 0; s < SHARDS; s++) {
+            _shards[s].capacity = capacity / SHARDS;
+        }
+    }
+
+    ~BlockCache() {
+        for (int s = 0; s < SHARDS; s++) {
+            for (auto &e : _shards[s].pages) {
+                free(e.second.buf);
+            }
+        }
+    }
+
+    // an id no other file read through this cache has
+    uint64_t newFileID() {
+        return _nextFileID.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Call f(data) with page `page` of file fileID, which is the `bytes`
+    // bytes at `offset` of fd; read it from fd first if it is not cached.
+    // direct says fd was opened with O_DIRECT. f runs under the page's shard
+    // lock, so it should only copy out what it needs.
+    template <class F>
+    void withPage(uint64_t fileID, uint64_t page, int fd, bool direct, off_t offset, size_t bytes, F f) {
+        uint64_t key = (fileID << 32) | page;
+        Shard &s = _shards[hash<uint64_t>()(key) % SHARDS];
+        {
+            lock_guard<mutex> l(s.lock);
+            auto it = s.pages.find(key);
+            if (it != s.pages.end()) {
+                s.hits++;
+                touch(s, it->second);
+                f(it->second.data);
+                return;
+            }
+        }
+        // read outside the lock; if another thread read the page meanwhile, keep its copy
+        Page p = readPage(fd, direct, offset, bytes);
+        lock_guard<mutex> l(s.lock);
+        s.misses++;
+        auto it = s.pages.find(key);
+        if (it != s.pages.end()) {
+            free(p.buf);
+            touch(s, it->second);
+            f(it->second.data);
+            return;
+        }
+        if (p.allocated > s.capacity) {
+            f(p.data);
+            free(p.buf);
+            return;
+        }
+        makeRoom(s, p.allocated);
+        auto ghost = s.ghostIndex.find(key);
+        if (ghost != s.ghostIndex.end()) {
+            s.ghosts.erase(ghost->second);
+            s.ghostIndex.erase(ghost);
+            p.inAm = true;
+            s.am.push_front(key);
+            p.pos = s.am.begin();
+        }
+        else {
+            p.inAm = false;
+            s.a1in.push_front(key);
+            p.pos = s.a1in.begin();
+            s.a1inBytes += p.allocated;
+        }
+        s.bytes += p.allocated;
+        Page &cached = s.pages[key] = p;
+        f(cached.data);
+    }
+
+    size_t capacity() {
+        return _capacity;
+    }
+    // bytes of pages held right now
+    size_t bytes() {
+        return sum(&Shard::bytes);
+    }
+    uint64_t hits() {
+        return sum(&Shard::hits);
+    }
+    uint64_t misses() {
+        return sum(&Shard::misses);
+    }
+
+private:
+    static const int SHARDS = 16;
+
+    struct Page {
+        char *buf; // what was read, aligned for O_DIRECT
+        const char *data; // the page itself, within buf
+        size_t allocated;
+        bool inAm;
+        list<uint64_t>::iterator pos; // in a1in or am
+    };
+
+    struct Shard {
+        mutex lock;
+        size_t capacity;
+        size_t bytes = 0;
+        size_t a1inBytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        unordered_map<uint64_t, Page> pages;
+        list<uint64_t> a1in; // newest first
+        list<uint64_t> am; // most recently used first
+        list<uint64_t> ghosts; // keys pushed out of a1in, newest first
+        unordered_map<uint64_t, list<uint64_t>::iterator> ghostIndex;
+    };
+
+    size_t _capacity;
+    atomic<uint64_t> _nextFileID;
+    Shard _shards[SHARDS];
+
+    // a hit in Am moves the page to the front; one in A1in leaves it be,
+    // since being read twice in quick succession says little about later
+    void touch(Shard &s, Page &p) {
+        if (p.inAm) {
+            s.am.splice(s.am.begin(), s.am, p.pos);
+        }
+    }
+
+    // evict until `bytes` (at most the shard's capacity) more fit: from A1in while it is over its quarter
+    // (remembering the key in A1out), otherwise the least recently used of Am
+    void makeRoom(Shard &s, size_t bytes) {
+        while (s.bytes + bytes > s.capacity && !s.pages.empty()) {
+            bool fromA1in = !s.a1in.empty() && (s.a1inBytes > s.capacity / 4 || s.am.empty());
+            uint64_t victim = fromA1in ? s.a1in.back() : s.am.back();
+            auto it = s.pages.find(victim);
+            s.bytes -= it->second.allocated;
+            free(it->second.buf);
+            if (fromA1in) {
+                s.a1inBytes -= it->second.allocated;
+                s.a1in.pop_back();
+                s.ghosts.push_front(victim);
+                s.ghostIndex[victim] = s.ghosts.begin();
+                // A1out remembers about half the capacity's worth of pages
+                while (s.ghosts.size() * it->second.allocated > s.capacity / 2) {
+                    s.ghostIndex.erase(s.ghosts.back());
+                    s.ghosts.pop_back();
+                }
+            }
+            else {
+                s.am.pop_back();
+            }
+            s.pages.erase(it);
+        }
+    }
+
+    static Page readPage(int fd, bool direct, off_t offset, size_t bytes) {
+        size_t align = direct ? DIRECT_ALIGN : 1;
+        off_t first = offset - offset % align;
+        size_t len = (offset + bytes - first + align - 1) / align * align;
+        Page p;
+        if (posix_memalign((void **) &p.buf, DIRECT_ALIGN, len) != 0) {
+            perror("Error allocating a block cache page");
+            exit(EXIT_FAILURE);
+        }
+        size_t done = 0;
+        while (done < offset + bytes - first) {
+            ssize_t r = pread(fd, p.buf + done, len - done, first + done);
+            if (r == -1 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                perror("Error reading a run page");
+                exit(EXIT_FAILURE);
+            }
+            done += r;
+        }
+        p.data = p.buf + (offset - first);
+        p.allocated = len;
+        return p;
+    }
+
+    template <class T>
+    T sum(T Shard::*field) {
+        T total = 0;
+        for (int s = 0; s < SHARDS; s++) {
+            lock_guard<mutex> l(_shards[s].lock);
+            total += _shards[s].*field;
+        }
+        return total;
+    }
+};
+
+#endif /* blockCache_h */
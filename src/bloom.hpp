@@ -28,27 +28,92 @@
 #include <vector>
 #include <array>
 #include <math.h>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
 
 #include "MurmurHash.h"
 
 using namespace std;
 
+// Both filters can be written out and mapped back in: data()/dataBytes() are
+// the raw bits, and attach() points an empty filter (default constructed) at
+// bits saved earlier without copying them. An attached filter does not own
+// its memory and must not be added to.
 template<class Key>
 class BloomFilter {
 public:
+    BloomFilter(): m_numHashes(0), m_size(0), m_bits(NULL), m_owned(false) {}
+    
     BloomFilter(uint64_t n, double fp) {
         
         double denom = 0.480453013918201; // (ln(2))^2
 
         double size = -1 * (double) n * (log(fp) / denom);
         
-        m_bits = vector<bool>((int) size);
+        m_size = (uint64_t) size;
+        m_bits = (uint64_t *) calloc((m_size + 63) / 64 + 1, sizeof(uint64_t));
+        if (m_bits == NULL) {
+            perror("Error allocating bloom filter");
+            exit(EXIT_FAILURE);
+        }
+        m_owned = true;
         
         double ln2 = 0.693147180559945;
         m_numHashes = (int) ceil( (size / n) * ln2);  // ln(2)
     }
     
-    array<uint64_t, 2> hash(const Key *data, size_t len) {
+    BloomFilter(const BloomFilter &other) = delete;
+    BloomFilter &operator=(const BloomFilter &other) = delete;
+    
+    BloomFilter(BloomFilter &&other): m_numHashes(other.m_numHashes), m_size(other.m_size), m_bits(other.m_bits), m_owned(other.m_owned) {
+        other.m_bits = NULL;
+        other.m_owned = false;
+    }
+    
+    BloomFilter &operator=(BloomFilter &&other) {
+        swap(m_numHashes, other.m_numHashes);
+        swap(m_size, other.m_size);
+        swap(m_bits, other.m_bits);
+        swap(m_owned, other.m_owned);
+        return *this;
+    }
+    
+    ~BloomFilter() {
+        if (m_owned) {
+            free(m_bits);
+        }
+    }
+    
+    const void *data() const {
+        return m_bits;
+    }
+    
+    size_t dataBytes() const {
+        return (m_size + 63) / 64 * sizeof(uint64_t);
+    }
+    
+    uint64_t numBits() const {
+        return m_size;
+    }
+    
+    int numHashes() const {
+        return m_numHashes;
+    }
+    
+    void attach(const void *bits, uint64_t numBits, int numHashes) {
+        if (m_owned) {
+            free(m_bits);
+        }
+        m_bits = (uint64_t *) bits;
+        m_size = numBits;
+        m_numHashes = numHashes;
+        m_owned = false;
+    }
+    
+    // every filter of a given type hashes a key the same way, so callers that
+    // probe many filters can hash once and use the array overloads below
+    static array<uint64_t, 2> hash(const Key *data, size_t len) {
         
         array<uint64_t, 2> hashValue;
         
@@ -62,18 +127,34 @@ public:
     }
     
     void add(const Key *data, size_t len) {
+        add(hash(data, len));
+    }
+    
+    void add(const array<uint64_t, 2> &hashValues) {
+        for (int n = 0; n < m_numHashes; n++) {
+            uint64_t bit = nthHash(n, hashValues[0], hashValues[1], m_size);
+            m_bits[bit >> 6] |= 1ULL << (bit & 63);
+        }
+    }
+    
+    // same as add, but safe against other threads adding to (or probing) this filter
+    void addConcurrent(const Key *data, size_t len) {
         auto hashValues = hash(data, len);
         
         for (int n = 0; n < m_numHashes; n++) {
-            m_bits[nthHash(n, hashValues[0], hashValues[1], m_bits.size())] = true;
+            uint64_t bit = nthHash(n, hashValues[0], hashValues[1], m_size);
+            __atomic_fetch_or(&m_bits[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
         }
     }
     
     bool mayContain(const Key *data, size_t len) {
-        auto hashValues = hash(data, len);
-        
+        return mayContain(hash(data, len));
+    }
+    
+    bool mayContain(const array<uint64_t, 2> &hashValues) {
         for (int n = 0; n < m_numHashes; n++) {
-            if (!m_bits[nthHash(n, hashValues[0], hashValues[1], m_bits.size())]) {
+            uint64_t bit = nthHash(n, hashValues[0], hashValues[1], m_size);
+            if (!(__atomic_load_n(&m_bits[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63)))) {
                 return false;
             }
         }
@@ -81,12 +162,204 @@ public:
         return true;
     }
     
+    // start loading the word mayContain(hashValues) reads first. A key that
+    // is not there is usually ruled out by it; loading all k words would
+    // only crowd out the loads of the other keys in a batch.
+    void prefetch(const array<uint64_t, 2> &hashValues) {
+        __builtin_prefetch(&m_bits[nthHash(0, hashValues[0], hashValues[1], m_size) >> 6]);
+    }
+    
 private:
     uint8_t m_numHashes;
-    vector<bool> m_bits;
+    uint64_t m_size; // in bits
+    uint64_t *m_bits;
+    bool m_owned;
 };
 
 
 
 
+// Cache-line-blocked Bloom filter: the first hash picks one 64-byte block
+// (with a multiply-shift instead of a modulo) and every probe for the key
+// lands inside that block, so a lookup costs one cache miss no matter how
+// many hash functions there are. Blocks fill unevenly, so for the same memory
+// the false positive rate is higher than BloomFilter's; the constructor
+// grows the bit budget until the blocked rate meets the requested one.
+template<class Key>
+class BlockedBloomFilter {
+public:
+    static const uint64_t BLOCK_BITS = 512;
+    static const uint64_t WORDS_PER_BLOCK = BLOCK_BITS / 64;
+    
+    BlockedBloomFilter(): m_numHashes(0), m_numBlocks(0), m_bits(NULL), m_owned(false) {}
+    
+    BlockedBloomFilter(uint64_t n, double fp) {
+        
+        double denom = 0.480453013918201; // (ln(2))^2
+        double ln2 = 0.693147180559945;
+        
+        double bitsPerKey = -1 * (log(fp) / denom);
+        while (blockedFPR(bitsPerKey, (int) ceil(bitsPerKey * ln2)) > fp && bitsPerKey < 64) {
+            bitsPerKey *= 1.05;
+        }
+        double size = bitsPerKey * n;
+        
+        m_numBlocks = (uint64_t) ceil(size / BLOCK_BITS);
+        if (m_numBlocks == 0){
+            m_numBlocks = 1;
+        }
+        if (posix_memalign((void **) &m_bits, 64, m_numBlocks * WORDS_PER_BLOCK * sizeof(uint64_t))) {
+            perror("Error allocating bloom filter");
+            exit(EXIT_FAILURE);
+        }
+        memset(m_bits, 0, m_numBlocks * WORDS_PER_BLOCK * sizeof(uint64_t));
+        m_owned = true;
+        
+        m_numHashes = (int) ceil(bitsPerKey * ln2);  // ln(2)
+    }
+    
+    // expected false positive rate with c bits per key and k probes: the
+    // number of keys in a block is Poisson with mean BLOCK_BITS / c
+    static double blockedFPR(double c, int k) {
+        double lambda = BLOCK_BITS / c;
+        double term = exp(-lambda); // P(i = 0)
+        double total = 0;
+        for (int i = 0; i < lambda * 4 + 50; i++) {
+            if (i > 0) {
+                term *= lambda / i;
+            }
+            total += term * pow(1 - pow(1 - 1.0 / BLOCK_BITS, (double) i * k), k);
+        }
+        return total;
+    }
+    
+    BlockedBloomFilter(const BlockedBloomFilter &other) = delete;
+    BlockedBloomFilter &operator=(const BlockedBloomFilter &other) = delete;
+    
+    BlockedBloomFilter(BlockedBloomFilter &&other): m_numHashes(other.m_numHashes), m_numBlocks(other.m_numBlocks), m_bits(other.m_bits), m_owned(other.m_owned) {
+        other.m_bits = NULL;
+        other.m_owned = false;
+    }
+    
+    BlockedBloomFilter &operator=(BlockedBloomFilter &&other) {
+        swap(m_numHashes, other.m_numHashes);
+        swap(m_numBlocks, other.m_numBlocks);
+        swap(m_bits, other.m_bits);
+        swap(m_owned, other.m_owned);
+        return *this;
+    }
+    
+    ~BlockedBloomFilter() {
+        if (m_owned) {
+            free(m_bits);
+        }
+    }
+    
+    const void *data() const {
+        return m_bits;
+    }
+    
+    size_t dataBytes() const {
+        return m_numBlocks * WORDS_PER_BLOCK * sizeof(uint64_t);
+    }
+    
+    uint64_t numBits() const {
+        return m_numBlocks * BLOCK_BITS;
+    }
+    
+    int numHashes() const {
+        return m_numHashes;
+    }
+    
+    // bits should be 64-byte aligned so every block stays within one cache line
+    void attach(const void *bits, uint64_t numBits, int numHashes) {
+        if (m_owned) {
+            free(m_bits);
+        }
+        m_bits = (uint64_t *) bits;
+        m_numBlocks = numBits / BLOCK_BITS;
+        m_numHashes = numHashes;
+        m_owned = false;
+    }
+    
+    // every filter of a given type hashes a key the same way, so callers that
+    // probe many filters can hash once and use the array overloads below
+    static array<uint64_t, 2> hash(const Key *data, size_t len) {
+        
+        array<uint64_t, 2> hashValue;
+        
+        MurmurHash3_x64_128(data, (int) len, 0, hashValue.data());
+        
+        return hashValue;
+    }
+    
+    void add(const Key *data, size_t len) {
+        add(hash(data, len));
+    }
+    
+    void add(const array<uint64_t, 2> &hashValues) {
+        uint64_t *block = blockFor(hashValues[0]);
+        uint64_t g = hashValues[1];
+        
+        for (int n = 0; n < m_numHashes; n++) {
+            uint32_t bit = nextBit(g);
+            block[bit >> 6] |= 1ULL << (bit & 63);
+        }
+    }
+    
+    void addConcurrent(const Key *data, size_t len) {
+        auto hashValues = hash(data, len);
+        uint64_t *block = blockFor(hashValues[0]);
+        uint64_t g = hashValues[1];
+        
+        for (int n = 0; n < m_numHashes; n++) {
+            uint32_t bit = nextBit(g);
+            __atomic_fetch_or(&block[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
+        }
+    }
+    
+    bool mayContain(const Key *data, size_t len) {
+        return mayContain(hash(data, len));
+    }
+    
+    bool mayContain(const array<uint64_t, 2> &hashValues) {
+        const uint64_t *block = blockFor(hashValues[0]);
+        uint64_t g = hashValues[1];
+        
+        for (int n = 0; n < m_numHashes; n++) {
+            uint32_t bit = nextBit(g);
+            if (!(__atomic_load_n(&block[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63)))) {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    // start loading the block mayContain(hashValues) will read
+    void prefetch(const array<uint64_t, 2> &hashValues) {
+        __builtin_prefetch(blockFor(hashValues[0]));
+    }
+    
+private:
+    uint8_t m_numHashes;
+    uint64_t m_numBlocks;
+    uint64_t *m_bits;
+    bool m_owned;
+    
+    // successive probe positions come from the top bits of a multiplicative
+    // sequence; plain double hashing mod 512 repeats patterns far too often
+    static inline uint32_t nextBit(uint64_t &g) {
+        g *= 0x9E3779B97F4A7C15ULL;
+        return (uint32_t) (g >> 55);
+    }
+    
+    inline uint64_t *blockFor(uint64_t h) {
+        // maps h uniformly onto [0, m_numBlocks) without a division
+        uint64_t blockIdx = (uint64_t) (((unsigned __int128) h * m_numBlocks) >> 64);
+        return m_bits + blockIdx * WORDS_PER_BLOCK;
+    }
+};
+
+
 #endif /* bloom_h */
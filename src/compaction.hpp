@@ -0,0 +1,113 @@
+//
+//  compaction.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef compaction_h
+#define compaction_h
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+// A fixed pool of threads that run merge tasks in the order they are
+// submitted. It knows nothing about levels: the tree decides which merges
+// are ready (see LSM::readyMerges) and submits only those, and a finished
+// merge submits whatever it made ready before it returns, so waitIdle()
+// covers a whole cascade. With zero threads submit() runs the task on the
+// calling thread, which makes every merge synchronous.
+class CompactionScheduler {
+public:
+    CompactionScheduler(unsigned threads): _pending(0), _stop(false) {
+        for (unsigned i = 0; i < threads; ++i) {
+            _workers.push_back(thread(&CompactionScheduler::work, this));
+        }
+    }
+
+    // runs whatever is still queued, then stops the workers
+    ~CompactionScheduler() {
+        {
+            lock_guard<mutex> l(_lock);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (size_t i = 0; i < _workers.size(); ++i) {
+            _workers[i].join();
+        }
+    }
+
+    void submit(const function<void()> &task) {
+        if (_workers.empty()) {
+            task();
+            return;
+        }
+        {
+            lock_guard<mutex> l(_lock);
+            _queue.push_back(task);
+            ++_pending;
+        }
+        _wake.notify_one();
+    }
+
+    // block until every submitted task, and every task those submitted, is done
+    void waitIdle() {
+        unique_lock<mutex> l(_lock);
+        _idle.wait(l, [this]{ return _pending == 0; });
+    }
+
+    unsigned threads() const {
+        return (unsigned) _workers.size();
+    }
+
+private:
+    vector<thread> _workers;
+    deque<function<void()>> _queue;
+    unsigned long _pending; // queued or running
+    bool _stop;
+    mutex _lock;
+    condition_variable _wake;
+    condition_variable _idle;
+
+    void work() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> l(_lock);
+                _wake.wait(l, [this]{ return _stop || !_queue.empty(); });
+                if (_queue.empty()) {
+                    return;
+                }
+                task = _queue.front();
+                _queue.pop_front();
+            }
+            task();
+            lock_guard<mutex> l(_lock);
+            if (--_pending == 0) {
+                _idle.notify_all();
+            }
+        }
+    }
+};
+
+#endif /* compaction_h */
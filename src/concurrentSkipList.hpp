@@ -0,0 +1,363 @@
+//
+//  concurrentSkipList.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef CONCURRENTSKIPLIST_H
+#define CONCURRENTSKIPLIST_H
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <vector>
+
+#include "run.hpp"
+#include "interleave.hpp"
+using namespace std;
+
+// Lock-free skiplist for the memory buffer. Any number of threads may call
+// insert_key at once: a node is published by a CAS on its level 1 link, and
+// its upper levels are linked afterwards with CAS as well, so readers always
+// see a valid (if momentarily shorter) tower. Nodes are never unlinked while
+// the list is live; the LSM deletes with tombstones, so delete_key only marks
+// the node and the memory goes away with the whole list after a merge.
+
+template<class K,class V, unsigned MAXLEVEL>
+class ConcurrentSkipList_Node {
+
+public:
+    const K key;
+    atomic<V> value;
+    atomic<bool> deleted;
+    const int height;
+    atomic<ConcurrentSkipList_Node<K,V,MAXLEVEL>*> _forward[MAXLEVEL+1];
+
+    ConcurrentSkipList_Node(const K searchKey, const V val, const int h):key(searchKey), value(val), deleted(false), height(h) {
+        for (int i=1; i<=MAXLEVEL; i++) {
+            _forward[i].store(NULL, memory_order_relaxed);
+        }
+    }
+};
+
+
+template<class K, class V, int MAXLEVEL = 12>
+class ConcurrentSkipList : public Run<K,V>
+{
+public:
+
+    typedef ConcurrentSkipList_Node<K,V,MAXLEVEL> Node;
+    static const bool concurrent = true;
+
+    const int max_level;
+
+    ConcurrentSkipList(const K minKey,const K maxKey):max_level(MAXLEVEL), min(maxKey), max(minKey),
+    _minKey(minKey),_maxKey(maxKey), _n(0), _maxSize(0)
+    {
+        p_listHead = new Node(_minKey, (V) NULL, MAXLEVEL);
+        p_listTail = new Node(_maxKey, (V) NULL, MAXLEVEL);
+        for (int i=1; i<=MAXLEVEL; i++) {
+            p_listHead->_forward[i].store(p_listTail, memory_order_relaxed);
+        }
+    }
+
+    ~ConcurrentSkipList()
+    {
+        Node* currNode = p_listHead->_forward[1].load(memory_order_relaxed);
+        while (currNode != p_listTail) {
+            Node* tempNode = currNode;
+            currNode = currNode->_forward[1].load(memory_order_relaxed);
+            delete tempNode;
+        }
+        delete p_listHead;
+        delete p_listTail;
+    }
+
+    void insert_key(const K &key, const V &value) {
+        _n.fetch_add(1, memory_order_relaxed);
+        do_insert(key, value);
+    }
+    
+    // Like insert_key, but refuses to grow the list past the size given to
+    // set_size. Room for the new node is reserved up front, so racing writers
+    // can never overfill the run; returns false if the run is already full.
+    bool insert_key_bounded(const K &key, const V &value) {
+        if (_n.fetch_add(1, memory_order_relaxed) >= _maxSize) {
+            _n.fetch_sub(1, memory_order_relaxed);
+            return update_existing(key, value);
+        }
+        do_insert(key, value);
+        return true;
+    }
+
+    void delete_key(const K &searchKey) {
+        Node* preds[MAXLEVEL+1];
+        Node* succs[MAXLEVEL+1];
+        if (find(searchKey, preds, succs)) {
+            succs[1]->deleted.store(true, memory_order_release);
+        }
+    }
+
+    V lookup(const K &searchKey, bool &found) {
+        Node* currNode = p_listHead;
+        for(int level = MAXLEVEL; level >= 1; level--) {
+            Node* next = currNode->_forward[level].load(memory_order_acquire);
+            while (next->key < searchKey) {
+                currNode = next;
+                next = currNode->_forward[level].load(memory_order_acquire);
+            }
+        }
+        currNode = currNode->_forward[1].load(memory_order_acquire);
+        if (currNode != p_listTail && currNode->key == searchKey && !currNode->deleted.load(memory_order_acquire)) {
+            found = true;
+            return currNode->value.load(memory_order_acquire);
+        }
+        return (V) NULL;
+    }
+
+#ifdef LSM_COROUTINES
+    // lookup, yielding before each node it has not visited yet (see interleave.hpp)
+    LookupTask<LookupResult<V>> lookupTask(const K searchKey) {
+        Node* currNode = p_listHead;
+        Node* stoppedAt = NULL; // the node that ended the search on the level above
+        for(int level = MAXLEVEL; level >= 1; level--) {
+            Node* next = currNode->_forward[level].load(memory_order_acquire);
+            if (next != stoppedAt) {
+                co_await prefetchAndYield(next);
+            }
+            while (next->key < searchKey) {
+                currNode = next;
+                next = currNode->_forward[level].load(memory_order_acquire);
+                co_await prefetchAndYield(next);
+            }
+            stoppedAt = next;
+        }
+        currNode = currNode->_forward[1].load(memory_order_acquire);
+        if (currNode != p_listTail && currNode->key == searchKey && !currNode->deleted.load(memory_order_acquire)) {
+            co_return LookupResult<V>{true, currNode->value.load(memory_order_acquire)};
+        }
+        co_return LookupResult<V>{false, (V) NULL};
+    }
+#endif
+    
+    vector<KVPair<K,V>> get_all(){
+        vector<KVPair<K,V>> vec = vector<KVPair<K, V>>();
+        vec.reserve(_n.load(memory_order_relaxed));
+        Node* node = p_listHead->_forward[1].load(memory_order_acquire);
+        while (node != p_listTail){
+            if (!node->deleted.load(memory_order_acquire)){
+                KVPair<K,V> kv = {node->key, node->value.load(memory_order_acquire)};
+                vec.push_back(kv);
+            }
+            node = node->_forward[1].load(memory_order_acquire);
+        }
+        return vec;
+    }
+
+    vector<KVPair<K,V>> get_all_in_range(const K &key1, const K &key2){
+        if (key1 > get_max() || key2 < get_min()){
+            return (vector<KVPair<K,V>>) {};
+        }
+        vector<KVPair<K,V>> vec = vector<KVPair<K, V>>();
+        Node* node = p_listHead->_forward[1].load(memory_order_acquire);
+        while (node != p_listTail && node->key < key1){
+            node = node->_forward[1].load(memory_order_acquire);
+        }
+        while (node != p_listTail && node->key < key2){
+            if (!node->deleted.load(memory_order_acquire)){
+                KVPair<K,V> kv = {node->key, node->value.load(memory_order_acquire)};
+                vec.push_back(kv);
+            }
+            node = node->_forward[1].load(memory_order_acquire);
+        }
+        return vec;
+    }
+
+    // Forward cursor over the live (not deleted) nodes in key order. Nodes
+    // linked in after the cursor has passed their position are not seen.
+    class Cursor {
+    public:
+        Cursor(): _node(NULL), _tail(NULL) {}
+        
+        bool valid() const {
+            return _node != _tail;
+        }
+        const K &key() const {
+            return _node->key;
+        }
+        V value() const {
+            return _node->value.load(memory_order_acquire);
+        }
+        void next() {
+            _node = _node->_forward[1].load(memory_order_acquire);
+            skipDeleted();
+        }
+        
+    private:
+        friend class ConcurrentSkipList;
+        Cursor(Node *node, Node *tail): _node(node), _tail(tail) {
+            skipDeleted();
+        }
+        void skipDeleted() {
+            while (_node != _tail && _node->deleted.load(memory_order_acquire)) {
+                _node = _node->_forward[1].load(memory_order_acquire);
+            }
+        }
+        Node *_node;
+        Node *_tail;
+    };
+    
+    Cursor begin() {
+        return Cursor(p_listHead->_forward[1].load(memory_order_acquire), p_listTail);
+    }
+    
+    // cursor at the first live key >= key
+    Cursor seek(const K &key) {
+        Node* currNode = p_listHead;
+        for (int level = MAXLEVEL; level >= 1; level--) {
+            Node* next = currNode->_forward[level].load(memory_order_acquire);
+            while (next->key < key) {
+                currNode = next;
+                next = currNode->_forward[level].load(memory_order_acquire);
+            }
+        }
+        return Cursor(currNode->_forward[1].load(memory_order_acquire), p_listTail);
+    }
+
+    unsigned long long num_elements() {
+        return _n.load(memory_order_relaxed);
+    }
+
+    K get_min(){
+        return min.load(memory_order_relaxed);
+    }
+
+    K get_max(){
+        return max.load(memory_order_relaxed);
+    }
+
+    void set_size(unsigned long size){
+        _maxSize = size;
+    }
+
+    size_t get_size_bytes(){
+        return num_elements() * (sizeof(K) + sizeof(V));
+    }
+    
+    // nodes are allocated one by one, each with room for every level
+    size_t get_memory_bytes(){
+        return (num_elements() + 2) * sizeof(Node);
+    }
+
+private:
+
+    // caller has already counted the node in _n; give the slot back if the key was there
+    void do_insert(const K &key, const V &value) {
+        Node* preds[MAXLEVEL+1];
+        Node* succs[MAXLEVEL+1];
+        while (true) {
+            if (find(key, preds, succs)) {
+                // update the value if the key already exists
+                succs[1]->value.store(value, memory_order_release);
+                succs[1]->deleted.store(false, memory_order_release);
+                _n.fetch_sub(1, memory_order_relaxed);
+                return;
+            }
+            int insertLevel = generateNodeLevel();
+            Node* newNode = new Node(key, value, insertLevel);
+            for (int level = 1; level <= insertLevel; level++) {
+                newNode->_forward[level].store(succs[level], memory_order_relaxed);
+            }
+            // the level 1 link is the linearization point; losing it means someone
+            // changed our neighborhood (possibly inserting this very key), so retry
+            Node* expected = succs[1];
+            if (!preds[1]->_forward[1].compare_exchange_strong(expected, newNode, memory_order_release, memory_order_relaxed)) {
+                delete newNode;
+                continue;
+            }
+            for (int level = 2; level <= insertLevel; level++) {
+                while (true) {
+                    expected = succs[level];
+                    if (preds[level]->_forward[level].compare_exchange_strong(expected, newNode, memory_order_release, memory_order_relaxed)) {
+                        break;
+                    }
+                    find(key, preds, succs);
+                    newNode->_forward[level].store(succs[level], memory_order_relaxed);
+                }
+            }
+            updateBounds(key);
+            return;
+        }
+    }
+    
+    bool update_existing(const K &key, const V &value) {
+        Node* preds[MAXLEVEL+1];
+        Node* succs[MAXLEVEL+1];
+        if (!find(key, preds, succs)) {
+            return false;
+        }
+        succs[1]->value.store(value, memory_order_release);
+        succs[1]->deleted.store(false, memory_order_release);
+        return true;
+    }
+
+    // fills preds/succs with the last node < key and the first node >= key on every level
+    bool find(const K &key, Node** preds, Node** succs) {
+        Node* currNode = p_listHead;
+        for (int level = MAXLEVEL; level >= 1; level--) {
+            Node* next = currNode->_forward[level].load(memory_order_acquire);
+            while (next->key < key) {
+                currNode = next;
+                next = currNode->_forward[level].load(memory_order_acquire);
+            }
+            preds[level] = currNode;
+            succs[level] = next;
+        }
+        return succs[1] != p_listTail && succs[1]->key == key;
+    }
+
+    void updateBounds(const K &key) {
+        K cur = max.load(memory_order_relaxed);
+        while (key > cur && !max.compare_exchange_weak(cur, key, memory_order_relaxed)) {}
+        cur = min.load(memory_order_relaxed);
+        while (key < cur && !min.compare_exchange_weak(cur, key, memory_order_relaxed)) {}
+    }
+
+    int generateNodeLevel() {
+        // rand() serializes on a lock in glibc, so every writer keeps its own xorshift state
+        static thread_local uint32_t state = 2463534242u ^ (uint32_t) (uintptr_t) &state;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return __builtin_ctz(state | (1u << (MAXLEVEL - 1))) + 1;
+    }
+
+    atomic<K> min;
+    atomic<K> max;
+    K _minKey;
+    K _maxKey;
+    atomic<unsigned long long> _n;
+    size_t _maxSize;
+    Node* p_listHead;
+    Node* p_listTail;
+
+};
+
+
+
+#endif /* concurrentskiplist_h */
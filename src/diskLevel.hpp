@@ -28,6 +28,8 @@
 #include <cstring>
 #include "run.hpp"
 #include "diskRun.hpp"
+#include "mergeEngine.hpp"
+#include "metrics.hpp"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -37,90 +39,63 @@
 #include <sys/mman.h>
 #include <cassert>
 #include <algorithm>
-
-#define LEFTCHILD(x) 2 * x + 1
-#define RIGHTCHILD(x) 2 * x + 2
-#define PARENT(x) (x - 1) / 2
+#include <memory>
+#include <thread>
+#include <atomic>
 
 int TOMBSTONE = INT_MIN;
 
 using namespace std;
 
+// How a level takes in merges. A tiered level holds up to _numRuns runs, each
+// the output of one merge into it, and merges its oldest _mergeSize of them
+// down when it is full: cheap writes, more runs for a lookup to probe. A
+// leveled level holds one run that every incoming merge is merged into, and
+// moves it down whole once another merge would not fit: each pair is
+// rewritten up to _sizeRatio times per level, but a lookup probes one run.
+// LAZY_LEVELING is a tree-wide choice (see LSMOptions) that tiers every level
+// but the last.
+enum MergePolicy {
+    TIERING = 0,
+    LEVELING = 1,
+    LAZY_LEVELING = 2
+};
+
 
-template <class K, class V>
+template <class K, class V, class FilterType = BloomFilter<K>>
 class DiskLevel {
     
 public: // TODO make some of these private
     typedef KVPair<K,V> KVPair_t;
-    typedef pair<KVPair<K, V>, int> KVIntPair_t;
+    // runs are shared so that readers holding an older view of the tree keep
+    // them alive after a merge has dropped them from the level
+    typedef shared_ptr<DiskRun<K,V,FilterType>> DiskRunPtr;
     KVPair_t KVPAIRMAX;
-    KVIntPair_t KVINTPAIRMAX;
     V V_TOMBSTONE = (V) TOMBSTONE;
 
-    struct StaticHeap {
-        int size ;
-        vector<KVIntPair_t> arr;
-        KVIntPair_t max;
-        
-        StaticHeap(unsigned sz, KVIntPair_t mx) {
-            size = 0;
-            arr = vector<KVIntPair_t>(sz, mx);
-            max = mx;
-        }
-        
-        void push(KVIntPair_t blob) {
-            unsigned i = size++;
-            while(i && blob < arr[PARENT(i)]) {
-                arr[i] = arr[PARENT(i)] ;
-                i = PARENT(i) ;
-            }
-            arr[i] = blob ;
-        }
-        void heapify(int i) {
-            int smallest = (LEFTCHILD(i) < size && arr[LEFTCHILD(i)] < arr[i]) ? LEFTCHILD(i) : i ;
-            if(RIGHTCHILD(i) < size && arr[RIGHTCHILD(i)] < arr[smallest]) {
-                smallest = RIGHTCHILD(i);
-            }
-            if(smallest != i) {
-                KVIntPair_t temp = arr[i];
-                arr[i] = arr[smallest];
-                arr[smallest] = temp;
-                heapify(smallest) ;
-            }
-        }
-        
-        KVIntPair_t pop() {
-            KVIntPair_t ret = arr[0];
-            arr[0] = arr[--size];
-            heapify(0);
-            return ret;
-        }
-    };
-
-    
-    
-    
-    
-    
-    
     int _level;
     unsigned _pageSize; // number of elements per fence pointer
     unsigned long _runSize; // number of elts in a run
     unsigned _numRuns; // number of runs in a level
     unsigned _activeRun; // index of active run
     unsigned _mergeSize; // # of runs to merge downwards
-    double _bf_fp; // bloom filter false positive
-    vector<DiskRun<K,V> *> runs;
+    atomic<double> _bf_fp; // bloom filter false positive rate for runs sealed from now on
+    string _dir; // directory of a persistent tree, empty otherwise
+    unsigned _nextRunID; // run files are never renamed, so every run gets a fresh id
+    MergePolicy _policy;
+    unsigned _sizeRatio; // leveling: how many incoming merges the run has room for
+    BlockCache *_cache; // lookups read sealed runs through this, or through their mappings if NULL
+    vector<DiskRunPtr> runs; // a leveled level being merged into has its output run after its live one
 
     
     
-    DiskLevel<K,V>(unsigned int pageSize, int level, unsigned long runSize, unsigned numRuns, unsigned mergeSize, double bf_fp):_numRuns(numRuns), _runSize(runSize),_level(level), _pageSize(pageSize), _mergeSize(mergeSize), _activeRun(0), _bf_fp(bf_fp){
+    // a leveled level has one run of runSize pairs, so numRuns and mergeSize are 1
+    DiskLevel(unsigned int pageSize, int level, unsigned long runSize, unsigned numRuns, unsigned mergeSize, double bf_fp, const string &dir = "", MergePolicy policy = TIERING, unsigned sizeRatio = 0, BlockCache *cache = NULL):_numRuns(numRuns), _runSize(runSize),_level(level), _pageSize(pageSize), _mergeSize(mergeSize), _activeRun(0), _bf_fp(bf_fp), _dir(dir), _nextRunID(0), _policy(policy), _sizeRatio(sizeRatio), _cache(cache){
+        assert(_policy == TIERING || (_policy == LEVELING && _numRuns == 1 && _mergeSize == 1 && _sizeRatio > 0));
         KVPAIRMAX = (KVPair_t) {INT_MAX, 0};
-        KVINTPAIRMAX = KVIntPair_t(KVPAIRMAX, -1);
         
         for (int i = 0; i < _numRuns; i++){
-            DiskRun<K,V> * run = new DiskRun<K, V>(_runSize, pageSize, level, i, _bf_fp);
-            runs.push_back(run);
+            runs.push_back(DiskRunPtr(new DiskRun<K,V,FilterType>(_runSize, pageSize, level, _nextRunID++, _bf_fp, _dir, _cache)));
         }
 
         
@@ -129,74 +104,181 @@ public: // TODO make some of these private
         
     }
     
-    ~DiskLevel<K,V>(){
-        for (int i = 0; i< runs.size(); ++i){
-            delete runs[i];
+    // reopen a level from the manifest: liveRuns are the ids and lengths of its
+    // full runs, oldest first, and the remaining slots get fresh empty runs
+    DiskLevel(unsigned int pageSize, int level, unsigned long runSize, unsigned numRuns, unsigned mergeSize, double bf_fp, const string &dir, const vector<pair<unsigned, unsigned long>> &liveRuns, unsigned nextRunID, MergePolicy policy = TIERING, unsigned sizeRatio = 0, BlockCache *cache = NULL):_numRuns(numRuns), _runSize(runSize),_level(level), _pageSize(pageSize), _mergeSize(mergeSize), _activeRun(0), _bf_fp(bf_fp), _dir(dir), _nextRunID(nextRunID), _policy(policy), _sizeRatio(sizeRatio), _cache(cache){
+        KVPAIRMAX = (KVPair_t) {INT_MAX, 0};
+        
+        assert(liveRuns.size() <= _numRuns);
+        for (int i = 0; i < liveRuns.size(); i++){
+            runs.push_back(DiskRunPtr(new DiskRun<K,V,FilterType>(_dir, level, liveRuns[i].first, liveRuns[i].second, pageSize, _bf_fp, _cache)));
+            _activeRun++;
+        }
+        for (int i = _activeRun; i < _numRuns; i++){
+            runs.push_back(DiskRunPtr(new DiskRun<K,V,FilterType>(_runSize, pageSize, level, _nextRunID++, _bf_fp, _dir, _cache)));
         }
     }
     
-    void addRuns(vector<DiskRun<K, V> *> &runList, const unsigned long runLen, bool lastLevel) {
-        
-
-        StaticHeap h = StaticHeap((int) runList.size(), KVINTPAIRMAX);
-        vector<int> heads(runList.size(), 0);
+    // Merge runList into the active run and seal it, returning its length;
+    // the caller makes it visible with commitRun. runList is oldest first and
+    // on equal keys the newest run's pair wins. With workers > 1 a large merge
+    // is split into that many subcompactions that run side by side (see
+    // splitKeyRange). Output writes are charged to limiter, if given, and
+    // counted in metrics, if given.
+    unsigned long addRuns(vector<DiskRunPtr> &runList, bool lastLevel, unsigned workers = 1, RateLimiter *limiter = NULL, Metrics *metrics = NULL) {
+        uint64_t started = metrics ? Metrics::now() : 0;
+        unsigned long n = mergeRuns(runList, lastLevel, workers, limiter);
+        if (metrics){
+            metrics->add(Metrics::BYTES_COMPACTED, n * sizeof(KVPair_t));
+            metrics->record(Metrics::COMPACTION_LATENCY, Metrics::now() - started);
+        }
+        return n;
+    }
+    
+    unsigned long mergeRuns(vector<DiskRunPtr> &runList, bool lastLevel, unsigned workers, RateLimiter *limiter) {
+        unsigned long total = 0;
         for (int i = 0; i < runList.size(); i++){
-            KVPair_t kvp = runList[i]->map[0];
-            h.push(KVIntPair_t(kvp, i));
+            total += runList[i]->getCapacity();
+        }
+        if (workers > total / MIN_SUBCOMPACTION){
+            workers = (unsigned) (total / MIN_SUBCOMPACTION);
+        }
+        KVPair_t *out = activeRunMap();
+        if (workers <= 1){
+            vector<vector<unsigned long>> whole = splitKeyRange(runList, 1);
+            unsigned long n = mergeSlice(runList, whole[0], whole[1], out, _runSize, lastLevel, limiter);
+            sealRun(n);
+            return n;
         }
         
-        int j = -1;
-        K lastKey = INT_MAX;
-        unsigned lastk = INT_MIN;
-        while (h.size != 0){
-            auto val_run_pair = h.pop();
-            assert(val_run_pair != KVINTPAIRMAX); // TODO delete asserts
-            if (lastKey == val_run_pair.first.key){
-                if( lastk < val_run_pair.second){
-                    runs[_activeRun]->map[j] = val_run_pair.first;
-                }
-            }
-            else {
-                ++j;
-                if ( j != -1 && lastLevel && runs[_activeRun]->map[j].value == V_TOMBSTONE){
-                    --j;
-                }
-                runs[_activeRun]->map[j] = val_run_pair.first;
-            }
-            
-            lastKey = val_run_pair.first.key;
-            lastk = val_run_pair.second;
-            
-            unsigned k = val_run_pair.second;
-            if (++heads[k] < runList[k]->getCapacity()){
-                KVPair_t kvp = runList[k]->map[heads[k]];
-                h.push(KVIntPair_t(kvp, k));
+        // cuts[s][r] is where slice s starts in run r. Slice s is merged into
+        // the section of the output starting at the number of input pairs
+        // before it, which has room for it even if nothing is deduplicated.
+        vector<vector<unsigned long>> cuts = splitKeyRange(runList, workers);
+        unsigned slices = (unsigned) cuts.size() - 1;
+        vector<unsigned long> offsets(slices + 1, 0), counts(slices, 0);
+        for (unsigned s = 1; s <= slices; s++){
+            for (int r = 0; r < runList.size(); r++){
+                offsets[s] += cuts[s][r];
             }
-                
         }
-        
-        if (lastLevel && runs[_activeRun]->map[j].value == V_TOMBSTONE){
-            --j;
+        vector<thread> threads;
+        for (unsigned s = 1; s < slices; s++){
+            threads.push_back(thread([&, s]{
+                counts[s] = mergeSlice(runList, cuts[s], cuts[s + 1], out + offsets[s], offsets[s + 1] - offsets[s], lastLevel, limiter);
+            }));
         }
-        runs[_activeRun]->setCapacity(j + 1);
-        runs[_activeRun]->constructIndex();
-        if(j + 1 > 0){
-            ++_activeRun;
+        counts[0] = mergeSlice(runList, cuts[0], cuts[1], out, offsets[1], lastLevel, limiter);
+        for (int i = 0; i < threads.size(); i++){
+            threads[i].join();
         }
         
+        // stitch: slide every section down against the one before it
+        unsigned long n = counts[0];
+        for (unsigned s = 1; s < slices; s++){
+            if (n != offsets[s]){
+                memmove(out + n, out + offsets[s], counts[s] * sizeof(KVPair_t));
+            }
+            n += counts[s];
+        }
+        sealRun(n);
+        return n;
     }
     
     void addRunByArray(KVPair_t * runToAdd, const unsigned long runLen){
         assert(_activeRun < _numRuns);
-        assert(runLen == _runSize);
         runs[_activeRun]->writeData(runToAdd, 0, runLen);
+        finishRun(runLen);
+    }
+    
+    // For callers that produce a sorted run in place: write up to _runSize
+    // pairs into activeRunMap(), then hand the count to finishRun. Merges that
+    // run alongside readers of the level split that into sealRun, which does
+    // the work, and commitRun, which only bumps the run count.
+    KVPair_t *activeRunMap(){
+        assert(_activeRun < runs.size());
+        return runs[_activeRun]->map;
+    }
+    
+    void finishRun(const unsigned long runLen){
+        sealRun(runLen);
+        commitRun(runLen);
+    }
+    
+    // build the active run's index and make it durable
+    void sealRun(const unsigned long runLen){
+        assert(runLen <= _runSize); // concurrent writers may leave a buffer run short
+        if (runLen == 0){
+            return;
+        }
+        runs[_activeRun]->setCapacity(runLen);
+        double fp = _bf_fp.load(memory_order_relaxed);
+        if (runs[_activeRun]->getFalsePositiveRate() != fp){
+            runs[_activeRun]->resetFilter(runLen, fp); // the rate changed since the run was made
+        }
         runs[_activeRun]->constructIndex();
-        _activeRun++;
+        if (!_dir.empty()){
+            runs[_activeRun]->persist();
+        }
+        runs[_activeRun]->startCachedReads();
     }
     
+    void commitRun(const unsigned long runLen){
+        if (_policy == LEVELING && _activeRun == 1){
+            // the merged run replaces the one it was merged with
+            runs.erase(runs.begin());
+            _activeRun = runLen > 0 ? 1 : 0;
+            return;
+        }
+        if (runLen > 0){
+            _activeRun++;
+        }
+    }
+    
+    DiskRunPtr activeRun(){
+        assert(_activeRun < runs.size());
+        return runs[_activeRun];
+    }
+    
+    // Before a merge into the level is handed out: a leveled level that has
+    // a run needs a second one to merge into. Caller holds the tree's lock.
+    void prepareOutput(){
+        while (runs.size() <= _activeRun){
+            runs.push_back(DiskRunPtr(new DiskRun<K,V,FilterType>(_runSize, _pageSize, _level, _nextRunID++, _bf_fp, _dir, _cache)));
+        }
+    }
+    
+    // runs of this level that a merge into it must take as its oldest inputs
+    vector<DiskRunPtr> mergeTargets(){
+        if (_policy == LEVELING){
+            return liveRuns();
+        }
+        return vector<DiskRunPtr>();
+    }
     
-    vector<DiskRun<K,V> *> getRunsToMerge(){
-        vector<DiskRun<K, V> *> toMerge;
+    // most pairs one merge out of this level carries
+    unsigned long outgoingSize(){
+        return _policy == LEVELING ? _runSize : _runSize * _mergeSize;
+    }
+    
+    // Switch an empty level to another policy and shape; lazy leveling does
+    // this to a level that stops being the last one.
+    void reshape(MergePolicy policy, unsigned long runSize, unsigned numRuns, unsigned mergeSize, unsigned sizeRatio){
+        assert(_activeRun == 0);
+        _policy = policy;
+        _runSize = runSize;
+        _numRuns = numRuns;
+        _mergeSize = mergeSize;
+        _sizeRatio = sizeRatio;
+        runs.clear();
+        for (int i = 0; i < _numRuns; i++){
+            runs.push_back(DiskRunPtr(new DiskRun<K,V,FilterType>(_runSize, _pageSize, _level, _nextRunID++, _bf_fp, _dir, _cache)));
+        }
+    }
+    
+    
+    vector<DiskRunPtr> getRunsToMerge(){
+        vector<DiskRunPtr> toMerge;
         for (int i = 0; i < _mergeSize; i++){
             toMerge.push_back(runs[i]);
         }
@@ -205,34 +287,25 @@ public: // TODO make some of these private
         
     }
     
-    void freeMergedRuns(vector<DiskRun<K,V> *> &toFree){
+    // the merged runs go away once the last reader lets go of them
+    void freeMergedRuns(vector<DiskRunPtr> &toFree){
         assert(toFree.size() == _mergeSize);
         for (int i = 0; i < _mergeSize; i++){
             assert(toFree[i]->_level == _level);
-            delete toFree[i];
         }
         runs.erase(runs.begin(), runs.begin() + _mergeSize);
         _activeRun -= _mergeSize;
-        for (int i = 0; i < _activeRun; i++){
-
-            runs[i]->_runID = i;
-
-            string newName = ("C_" + to_string(runs[i]->_level) + "_" + to_string(runs[i]->_runID) + ".txt");
-            
-            if (rename(runs[i]->_filename.c_str(), newName.c_str())){
-                perror(("Error renaming file " + runs[i]->_filename + " to " + newName).c_str());
-                exit(EXIT_FAILURE);
-            }
-            runs[i]->_filename = newName;
-        }
         
         for (int i = _activeRun; i < _numRuns; i++){
-            DiskRun<K, V> * newRun = new DiskRun<K,V>(_runSize, _pageSize, _level, i, _bf_fp);
-            runs.push_back(newRun);
+            runs.push_back(DiskRunPtr(new DiskRun<K,V,FilterType>(_runSize, _pageSize, _level, _nextRunID++, _bf_fp, _dir, _cache)));
         }
     }
     
+    // no room for another incoming merge
     bool levelFull(){
+        if (_policy == LEVELING){
+            return _activeRun == 1 && runs[0]->getCapacity() + _runSize / _sizeRatio > _runSize;
+        }
         return (_activeRun == _numRuns);
     }
     bool levelEmpty(){
@@ -240,12 +313,32 @@ public: // TODO make some of these private
     }
     
     V lookup (const K &key, bool &found) {
-        int maxRunToSearch = levelFull() ? _numRuns - 1 : _activeRun - 1;
-        for (int i = maxRunToSearch; i >= 0; --i){
-            if (runs[i]->maxKey == INT_MIN || key < runs[i]->minKey || key > runs[i]->maxKey || !runs[i]->bf.mayContain(&key, sizeof(K))){
+        return lookup(key, FilterType::hash(&key, sizeof(K)), found);
+    }
+    
+    // keyHash is FilterType::hash of the key, computed once by the caller for every level
+    V lookup (const K &key, const array<uint64_t, 2> &keyHash, bool &found) {
+        return lookupRuns(runs, _activeRun, key, keyHash, found);
+    }
+    
+    // search the first n runs of a level, newest first; with metrics, count
+    // the filters' answers under levelIndex
+    static V lookupRuns (const vector<DiskRunPtr> &levelRuns, unsigned n, const K &key, const array<uint64_t, 2> &keyHash, bool &found, Metrics::Shard *metrics = NULL, int levelIndex = 0) {
+        for (int i = (int) n - 1; i >= 0; --i){
+            if (levelRuns[i]->maxKey == INT_MIN || key < levelRuns[i]->minKey || key > levelRuns[i]->maxKey){
+                continue;
+            }
+            if (!levelRuns[i]->bf.mayContain(keyHash)){
+                if (metrics){
+                    metrics->addLevel(Metrics::FILTER_NEGATIVES, levelIndex);
+                }
                 continue;
             }
-            V lookupRes = runs[i]->lookup(key, found);
+            V lookupRes = levelRuns[i]->lookup(key, found);
+            if (metrics){
+                metrics->add(Metrics::FENCE_SEARCHES);
+                metrics->addLevel(found ? Metrics::FILTER_TRUE_POSITIVES : Metrics::FILTER_FALSE_POSITIVES, levelIndex);
+            }
             if (found) {
                 return lookupRes;
             }
@@ -255,11 +348,65 @@ public: // TODO make some of these private
         return (V) NULL;
         
     }
+    
+    // Cut the key space of runList into up to `slices` ranges holding about
+    // the same number of pairs, at keys sampled from the runs' fence pointers.
+    // Returns slices + 1 rows of per-run start indices; the last row is every
+    // run's end. A key never straddles a cut, so slices merge independently.
+    static vector<vector<unsigned long>> splitKeyRange(vector<DiskRunPtr> &runList, unsigned slices){
+        vector<K> samples;
+        for (int r = 0; r < runList.size(); r++){
+            for (unsigned i = 0; i < runList[r]->numFencePointers(); i++){
+                samples.push_back(runList[r]->fencePointer(i));
+            }
+        }
+        sort(samples.begin(), samples.end());
+        
+        vector<vector<unsigned long>> cuts;
+        cuts.push_back(vector<unsigned long>(runList.size(), 0));
+        const K *last = NULL;
+        for (unsigned s = 1; s < slices; s++){
+            const K &bound = samples[samples.size() * s / slices];
+            if (last != NULL && !(*last < bound)){
+                continue; // a run of equal samples would make an empty slice
+            }
+            last = &bound;
+            vector<unsigned long> row;
+            for (int r = 0; r < runList.size(); r++){
+                row.push_back(runList[r]->lower_bound(bound));
+            }
+            cuts.push_back(row);
+        }
+        vector<unsigned long> ends;
+        for (int r = 0; r < runList.size(); r++){
+            ends.push_back(runList[r]->getCapacity());
+        }
+        cuts.push_back(ends);
+        return cuts;
+    }
+    
+    // the runs holding data, oldest first
+    vector<DiskRunPtr> liveRuns(){
+        return vector<DiskRunPtr>(runs.begin(), runs.begin() + _activeRun);
+    }
     unsigned long num_elements(){
         unsigned long total = 0;
         for (int i = 0; i < _activeRun; ++i)
             total += runs[i]->getCapacity();
         return total;
     }
+    
+private:
+    static const unsigned long MIN_SUBCOMPACTION = 1 << 16; // fewest pairs worth a thread
+    
+    // merge runList[r][begin[r], end[r]) for every run into dst
+    unsigned long mergeSlice(vector<DiskRunPtr> &runList, const vector<unsigned long> &begin, const vector<unsigned long> &end, KVPair_t *dst, unsigned long cap, bool lastLevel, RateLimiter *limiter){
+        vector<typename LoserTree<K,V>::Input> inputs;
+        for (int r = 0; r < runList.size(); r++){
+            inputs.push_back({runList[r]->map + begin[r], end[r] - begin[r]});
+        }
+        LoserTree<K,V> tree(inputs);
+        return tree.merge(dst, cap, V_TOMBSTONE, lastLevel, limiter);
+    }
 };
 #endif /* diskLevel_h */
@@ -24,8 +24,12 @@
 #include <vector>
 #include <cstdint>
 #include <cstring>
+#include <cerrno>
 #include <string>
 #include "run.hpp"
+#include "bloom.hpp"
+#include "interleave.hpp"
+#include "blockCache.hpp"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -39,11 +43,24 @@
 
 using namespace std;
 
-template <class K, class V> class DiskLevel;
+template <class K, class V, class FilterType> class DiskLevel;
 
-template <class K, class V>
+// How lookups read a sealed run. MMAP_RUNS reads it through the mapping it was
+// written through, leaving the kernel to decide which pages stay in memory.
+// PREAD_RUNS drops the run's pages from the kernel's cache once it is sealed
+// and reads a page at a time with pread, O_DIRECT where the file system allows
+// it, through the tree's BlockCache, which caps the memory pages take.
+// Merges and iterators read through the mapping either way: they stream
+// every page once, in order.
+enum RunBackend {
+    MMAP_RUNS = 0,
+    PREAD_RUNS = 1
+};
+
+// FilterType is the run's Bloom filter implementation (see bloom.hpp)
+template <class K, class V, class FilterType = BloomFilter<K>>
 class DiskRun {
-    friend class DiskLevel<K,V>;
+    friend class DiskLevel<K,V,FilterType>;
 public:
     typedef KVPair<K,V> KVPair_t;
 
@@ -60,14 +77,41 @@ public:
     KVPair_t *map;
     int fd;
     unsigned int pageSize;
-    BloomFilter<K> bf;
+    FilterType bf;
     
     K minKey = INT_MIN;
     K maxKey = INT_MIN;
     
-    DiskRun<K,V> (unsigned long capacity, unsigned int pageSize, int level, int runID, double bf_fp):_capacity(capacity),_level(level), _iMaxFP(0), pageSize(pageSize), _runID(runID), _bf_fp(bf_fp), bf(capacity, bf_fp) {
+    // Index file written next to a persistent run: this header, the fence
+    // pointers, then the filter bits at a 64-byte aligned offset. Reopening a
+    // run maps the file and uses the fence pointers and bits in place.
+    struct IndexHeader {
+        uint64_t magic;
+        uint64_t kvSize;
+        uint64_t capacity;
+        uint64_t pageSize;
+        uint64_t numFencePointers;
+        uint64_t filterOffset;
+        uint64_t filterBits;
+        uint64_t filterHashes;
+        K minKey;
+        K maxKey;
+    };
+    static const uint64_t INDEX_MAGIC = 0x736c736d69647831ULL; // "slsmidx1"
+    
+    // name of the file backing run runID of a level (ext "txt") or of its
+    // index (ext "idx"); dir is empty for the working directory
+    static string fileName(const string &dir, int level, unsigned runID, const string &ext = "txt"){
+        return (dir.empty() ? "" : dir + "/") + "C_" + to_string(level) + "_" + to_string(runID) + "." + ext;
+    }
+    
+    // A run whose dir is nonempty belongs to a persistent tree: its file outlives
+    // the object and is only removed once the manifest no longer names it.
+    // With a cache, lookups read the run through it once it is sealed (see
+    // RunBackend).
+    DiskRun (unsigned long capacity, unsigned int pageSize, int level, int runID, double bf_fp, const string &dir = "", BlockCache *cache = NULL):_capacity(capacity),_level(level), _iMaxFP(0), pageSize(pageSize), _runID(runID), _bf_fp(bf_fp), bf(capacity, bf_fp), _fencePointers(NULL), _persistent(!dir.empty()), _dir(dir), _indexMap(NULL), _indexBytes(0), _cache(cache), _readFd(-1) {
         
-        _filename = "C_" + to_string(level) + "_" + to_string(runID) + ".txt";
+        _filename = fileName(dir, level, runID);
         
         size_t filesize = capacity * sizeof(KVPair_t);
         
@@ -106,21 +150,120 @@ public:
         
         
     }
-    ~DiskRun<K,V>(){
+    // reopen a run written by an earlier process; capacity is its length from the manifest
+    DiskRun (const string &dir, int level, int runID, unsigned long capacity, unsigned int pageSize, double bf_fp, BlockCache *cache = NULL):_capacity(capacity),_level(level), _iMaxFP(0), pageSize(pageSize), _runID(runID), _bf_fp(bf_fp), _fencePointers(NULL), _persistent(true), _dir(dir), _indexMap(NULL), _indexBytes(0), _cache(cache), _readFd(-1) {
+        
+        _filename = fileName(dir, level, runID);
+        
+        fd = open(_filename.c_str(), O_RDWR);
+        if (fd == -1) {
+            perror(("Error opening run file " + _filename).c_str());
+            exit(EXIT_FAILURE);
+        }
+        
+        struct stat st;
+        size_t filesize = capacity * sizeof(KVPair_t);
+        if (fstat(fd, &st) == -1 || (size_t) st.st_size < filesize) {
+            close(fd);
+            fprintf(stderr, "Run file %s is shorter than the manifest says\n", _filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+        
+        map = (KVPair<K, V>*) mmap(0, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            perror("Error mmapping the file");
+            exit(EXIT_FAILURE);
+        }
+        
+        if (!loadIndex()){
+            // no usable index file (e.g. written by an older version): scan the run
+            bf = FilterType(capacity, bf_fp);
+            constructIndex();
+        }
+        startCachedReads();
+    }
+    
+    ~DiskRun(){
         fsync(fd);
         doUnmap();
+        if (_readFd != -1) {
+            close(_readFd);
+        }
+        if (_indexMap != NULL && munmap(_indexMap, _indexBytes) == -1) {
+            perror("Error un-mmapping the index file");
+        }
         
-        if (remove(_filename.c_str())){
+        if (!_persistent && remove(_filename.c_str())){
             perror(("Error removing file " + string(_filename)).c_str());
             exit(EXIT_FAILURE);
         }
     }
+    // force the run's contents to stable storage
+    void sync(){
+        if (msync(map, _capacity * sizeof(KVPair_t), MS_SYNC) == -1) {
+            perror("Error syncing the file");
+        }
+        fsync(fd);
+    }
+    
+    // write the index file, then sync the run; a persistent run must go
+    // through this before a manifest may name it
+    void persist(){
+        writeIndex();
+        sync();
+    }
+    
+    // With a block cache, once the run is sealed: write it back, drop its
+    // pages from the kernel's cache and open it again for lookups to pread
+    void startCachedReads(){
+        if (_cache == NULL || _readFd != -1 || _capacity == 0){
+            return;
+        }
+        size_t filesize = _capacity * sizeof(KVPair_t);
+        sync();
+        if (madvise(map, filesize, MADV_DONTNEED) == -1) {
+            perror("Error dropping the run's mapped pages");
+        }
+        posix_fadvise(fd, 0, filesize, POSIX_FADV_DONTNEED);
+        _direct = true;
+        _readFd = open(_filename.c_str(), O_RDONLY | O_DIRECT);
+        if (_readFd == -1 && errno == EINVAL) {
+            // the file system does not do direct I/O (tmpfs, for one)
+            _direct = false;
+            _readFd = open(_filename.c_str(), O_RDONLY);
+        }
+        if (_readFd == -1) {
+            perror(("Error opening run file " + _filename + " for reading").c_str());
+            exit(EXIT_FAILURE);
+        }
+        _cacheID = _cache->newFileID();
+    }
+    
     void setCapacity(unsigned long newCap){
         _capacity = newCap;
     }
     unsigned long getCapacity(){
         return _capacity;
     }
+    unsigned getRunID(){
+        return _runID;
+    }
+    double getFalsePositiveRate(){
+        return _bf_fp;
+    }
+    // replace the (still empty) filter with one for n keys at rate fp
+    void resetFilter(unsigned long n, double fp){
+        bf = FilterType(n, fp);
+        _bf_fp = fp;
+    }
+    // fence pointer i is the first key of page i
+    unsigned numFencePointers(){
+        return _capacity == 0 ? 0 : _iMaxFP + 1;
+    }
+    const K &fencePointer(unsigned i){
+        return _fencePointers[i];
+    }
     void writeData(const KVPair_t *run, const size_t offset, const unsigned long len) {
         
         memcpy(map + offset, run, len * sizeof(KVPair_t));
@@ -129,19 +272,17 @@ public:
     }
     void constructIndex(){
         // construct fence pointers and write BF
-//        _fencePointers.resize(0);
-        _fencePointers.reserve(_capacity / pageSize);
+        _fenceStorage.clear();
+        _fenceStorage.reserve(_capacity / pageSize + 1);
         _iMaxFP = -1; // TODO IS THIS SAFE?
         for (int j = 0; j < _capacity; j++) {
             bf.add((K*) &map[j].key, sizeof(K));
             if (j % pageSize == 0){
-                _fencePointers.push_back(map[j].key);
+                _fenceStorage.push_back(map[j].key);
                 _iMaxFP++;
             }
         }
-        if (_iMaxFP >= 0){
-            _fencePointers.resize(_iMaxFP + 1);
-        }
+        _fencePointers = _fenceStorage.data();
         
         minKey = map[0].key;
         maxKey = map[_capacity - 1].key;
@@ -224,12 +365,82 @@ public:
         return ret;
     }
     
+    // index of the first element >= key, or getCapacity() if there is none
+    unsigned long lower_bound(const K &key){
+        if (_capacity == 0 || key > maxKey){
+            return _capacity;
+        }
+        if (key <= minKey){
+            return 0;
+        }
+        bool found = false;
+        return get_index(key, found);
+    }
+    
      V lookup(const K &key, bool &found){
+         if (_readFd != -1){
+             unsigned long start, end;
+             get_flanking_FP(key, start, end);
+             return cachedSearch(start, end, key, found);
+         }
          unsigned long idx = get_index(key, found);
          V ret = map[idx].value;
          return found ? ret : (V) NULL;
      }
     
+    // lookup in two steps, for callers that interleave many keys: locate
+    // searches the fence pointers and starts loading the middle of the page
+    // the key would be on, where lookupIn's binary search starts
+    void locate(const K &key, unsigned long &start, unsigned long &end){
+        get_flanking_FP(key, start, end);
+        if (end > start && _readFd == -1){
+            __builtin_prefetch(&map[(start + end - 1) >> 1]);
+        }
+    }
+    
+    V lookupIn(const unsigned long start, const unsigned long end, const K &key, bool &found){
+        if (_readFd != -1){
+            return cachedSearch(start, end, key, found);
+        }
+        unsigned long idx = binary_search(start, end - start, key, found);
+        return found ? map[idx].value : (V) NULL;
+    }
+    
+#ifdef LSM_COROUTINES
+    // lookup, yielding before each cache line of the mapped page its binary
+    // search moves to (see interleave.hpp); the fence pointers are small
+    // enough to stay cached and are searched straight through
+    LookupTask<LookupResult<V>> lookupTask(const K key){
+        if (_readFd != -1){
+            // a page read blocks in pread, which a prefetch cannot hide
+            bool found = false;
+            V value = lookup(key, found);
+            co_return LookupResult<V>{found, value};
+        }
+        unsigned long start, end;
+        get_flanking_FP(key, start, end);
+        if (end == start){
+            co_return LookupResult<V>{true, map[start].value}; // as binary_search has it
+        }
+        unsigned long min = start, max = end - 1;
+        uintptr_t line = 0;
+        while (min <= max) {
+            unsigned long middle = (min + max) >> 1;
+            if (((uintptr_t) &map[middle] >> 6) != line){
+                line = (uintptr_t) &map[middle] >> 6;
+                co_await prefetchAndYield(&map[middle]);
+            }
+            if (key > map[middle].key)
+                min = middle + 1;
+            else if (key == map[middle].key)
+                co_return LookupResult<V>{true, map[middle].value};
+            else
+                max = middle - 1;
+        }
+        co_return LookupResult<V>{false, (V) NULL};
+    }
+#endif
+    
     void range(const K &key1, const K &key2, unsigned long &i1, unsigned long &i2){
         i1 = 0;
         i2 = 0;
@@ -262,10 +473,124 @@ private:
     unsigned long _capacity;
     string _filename;
     int _level;
-    vector<K> _fencePointers;
+    K *_fencePointers; // into _fenceStorage, or into the mapped index file
+    vector<K> _fenceStorage;
     unsigned _iMaxFP;
     unsigned _runID;
     double _bf_fp;
+    bool _persistent;
+    string _dir;
+    void *_indexMap;
+    size_t _indexBytes;
+    BlockCache *_cache; // NULL for MMAP_RUNS
+    int _readFd; // open for lookups once startCachedReads has run, -1 before
+    bool _direct; // _readFd has O_DIRECT
+    uint64_t _cacheID;
+    
+    // binary_search of [start, end), which lie in one page, in the cached copy of the page
+    V cachedSearch(const unsigned long start, const unsigned long end, const K &key, bool &found){
+        unsigned long page = start / pageSize;
+        unsigned long first = page * pageSize;
+        unsigned long n = min((unsigned long) pageSize, _capacity - first);
+        V value = (V) NULL;
+        _cache->withPage(_cacheID, page, _readFd, _direct, first * sizeof(KVPair_t), n * sizeof(KVPair_t), [&](const char *data){
+            const KVPair_t *pairs = (const KVPair_t *) data;
+            if (end == start){
+                found = true; // as binary_search has it: the key is the page's fence pointer
+                value = pairs[start - first].value;
+                return;
+            }
+            long min = start - first, max = end - 1 - first;
+            while (min <= max) {
+                long middle = (min + max) >> 1;
+                if (key > pairs[middle].key)
+                    min = middle + 1;
+                else if (key == pairs[middle].key) {
+                    found = true;
+                    value = pairs[middle].value;
+                    return;
+                }
+                else
+                    max = middle - 1;
+            }
+        });
+        return value;
+    }
+    
+    void writeIndex(){
+        IndexHeader h;
+        memset(&h, 0, sizeof(IndexHeader));
+        h.magic = INDEX_MAGIC;
+        h.kvSize = sizeof(KVPair_t);
+        h.capacity = _capacity;
+        h.pageSize = pageSize;
+        h.numFencePointers = _iMaxFP + 1;
+        h.filterOffset = (sizeof(IndexHeader) + h.numFencePointers * sizeof(K) + 63) & ~(uint64_t) 63;
+        h.filterBits = bf.numBits();
+        h.filterHashes = bf.numHashes();
+        h.minKey = minKey;
+        h.maxKey = maxKey;
+        
+        vector<char> out(h.filterOffset + bf.dataBytes(), 0);
+        memcpy(&out[0], &h, sizeof(IndexHeader));
+        memcpy(&out[sizeof(IndexHeader)], _fencePointers, h.numFencePointers * sizeof(K));
+        memcpy(&out[h.filterOffset], bf.data(), bf.dataBytes());
+        
+        string name = fileName(_dir, _level, _runID, "idx");
+        int ifd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, (mode_t) 0600);
+        if (ifd == -1) {
+            perror(("Error opening index file " + name).c_str());
+            exit(EXIT_FAILURE);
+        }
+        size_t done = 0;
+        while (done < out.size()) {
+            ssize_t w = write(ifd, &out[done], out.size() - done);
+            if (w == -1) {
+                if (errno == EINTR) continue;
+                perror(("Error writing index file " + name).c_str());
+                exit(EXIT_FAILURE);
+            }
+            done += w;
+        }
+        fsync(ifd);
+        close(ifd);
+    }
+    
+    // map the index file and point the fence pointers and filter into it;
+    // false if it is missing or does not describe this run
+    bool loadIndex(){
+        string name = fileName(_dir, _level, _runID, "idx");
+        int ifd = open(name.c_str(), O_RDONLY);
+        if (ifd == -1) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(ifd, &st) == -1 || (size_t) st.st_size < sizeof(IndexHeader)) {
+            close(ifd);
+            return false;
+        }
+        void *m = mmap(0, st.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+        close(ifd);
+        if (m == MAP_FAILED) {
+            return false;
+        }
+        const IndexHeader *h = (const IndexHeader *) m;
+        bool valid = h->magic == INDEX_MAGIC && h->kvSize == sizeof(KVPair_t) && h->capacity == _capacity && h->pageSize == pageSize
+            && h->filterOffset >= sizeof(IndexHeader) + h->numFencePointers * sizeof(K)
+            && h->filterOffset + (h->filterBits + 63) / 64 * sizeof(uint64_t) <= (uint64_t) st.st_size;
+        if (!valid) {
+            munmap(m, st.st_size);
+            return false;
+        }
+        _indexMap = m;
+        _indexBytes = st.st_size;
+        _fencePointers = (K *) ((char *) m + sizeof(IndexHeader));
+        _iMaxFP = (unsigned) (h->numFencePointers - 1);
+        bf.attach((char *) m + h->filterOffset, h->filterBits, (int) h->filterHashes);
+        minKey = h->minKey;
+        maxKey = h->maxKey;
+        return true;
+    }
                             
     void doMap(){
         
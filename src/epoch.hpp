@@ -0,0 +1,179 @@
+//
+//  epoch.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef epoch_h
+#define epoch_h
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// Epoch-based reclamation. A reader brackets its accesses with an EpochGuard,
+// which costs one store and one fence and never blocks. A writer that unlinks
+// an object hands it to retire() instead of deleting it; the object is freed
+// once every reader that was active when it was retired has left, so no
+// reader can be holding a pointer to it.
+class EpochManager {
+public:
+    static EpochManager &instance() {
+        static EpochManager manager;
+        return manager;
+    }
+
+    void enter() {
+        Slot *s = mySlot();
+        if (s->depth++ == 0) {
+            s->epoch.store(_global.load(memory_order_relaxed), memory_order_relaxed);
+            // the announcement must be visible before the reader loads any shared pointer
+            atomic_thread_fence(memory_order_seq_cst);
+        }
+    }
+
+    void exit() {
+        Slot *s = mySlot();
+        if (--s->depth == 0) {
+            s->epoch.store(QUIESCENT, memory_order_release);
+        }
+    }
+
+    // p is already unreachable for new readers; free it when the current ones are done
+    void retire(void *p, void (*deleter)(void *)) {
+        lock_guard<mutex> l(_retireLock);
+        uint64_t e = _global.fetch_add(1, memory_order_seq_cst);
+        _retired.push_back(Retired {p, deleter, e});
+        reclaimLocked();
+    }
+
+    // free whatever no reader can still see
+    void reclaim() {
+        lock_guard<mutex> l(_retireLock);
+        reclaimLocked();
+    }
+
+    ~EpochManager() {
+        for (size_t i = 0; i < _retired.size(); ++i) {
+            _retired[i].deleter(_retired[i].p);
+        }
+        Slot *s = _slots.load();
+        while (s != NULL) {
+            Slot *next = s->next;
+            delete s;
+            s = next;
+        }
+    }
+
+private:
+    static const uint64_t QUIESCENT = 0;
+
+    struct Slot {
+        atomic<uint64_t> epoch;
+        atomic<bool> inUse;
+        unsigned depth; // only touched by the owning thread
+        Slot *next;
+    };
+
+    struct Retired {
+        void *p;
+        void (*deleter)(void *);
+        uint64_t epoch;
+    };
+
+    // gives the thread's slot back when the thread exits
+    struct SlotHandle {
+        Slot *slot = NULL;
+        ~SlotHandle() {
+            if (slot != NULL) {
+                slot->inUse.store(false, memory_order_release);
+            }
+        }
+    };
+
+    atomic<uint64_t> _global;
+    atomic<Slot *> _slots;
+    mutex _retireLock;
+    vector<Retired> _retired;
+
+    EpochManager(): _global(1), _slots(NULL) {}
+
+    Slot *mySlot() {
+        static thread_local SlotHandle handle;
+        if (handle.slot == NULL) {
+            handle.slot = acquireSlot();
+        }
+        return handle.slot;
+    }
+
+    // slots are never freed while the program runs, so reuse one left by an exited thread
+    Slot *acquireSlot() {
+        for (Slot *s = _slots.load(memory_order_acquire); s != NULL; s = s->next) {
+            bool expected = false;
+            if (!s->inUse.load(memory_order_relaxed) && s->inUse.compare_exchange_strong(expected, true)) {
+                return s;
+            }
+        }
+        Slot *s = new Slot();
+        s->epoch.store(QUIESCENT, memory_order_relaxed);
+        s->inUse.store(true, memory_order_relaxed);
+        s->depth = 0;
+        s->next = _slots.load(memory_order_relaxed);
+        while (!_slots.compare_exchange_weak(s->next, s, memory_order_release, memory_order_relaxed)) {}
+        return s;
+    }
+
+    void reclaimLocked() {
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t oldest = UINT64_MAX;
+        for (Slot *s = _slots.load(memory_order_acquire); s != NULL; s = s->next) {
+            uint64_t e = s->epoch.load(memory_order_acquire);
+            if (e != QUIESCENT && e < oldest) {
+                oldest = e;
+            }
+        }
+        // a reader that announced epoch e may hold anything retired at e or later
+        size_t kept = 0;
+        for (size_t i = 0; i < _retired.size(); ++i) {
+            if (_retired[i].epoch < oldest) {
+                _retired[i].deleter(_retired[i].p);
+            }
+            else {
+                _retired[kept++] = _retired[i];
+            }
+        }
+        _retired.resize(kept);
+    }
+};
+
+class EpochGuard {
+public:
+    EpochGuard() {
+        EpochManager::instance().enter();
+    }
+    ~EpochGuard() {
+        EpochManager::instance().exit();
+    }
+    EpochGuard(const EpochGuard &other) = delete;
+    EpochGuard &operator=(const EpochGuard &other) = delete;
+};
+
+#endif /* epoch_h */
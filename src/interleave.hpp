@@ -0,0 +1,207 @@
+//
+//  interleave.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef interleave_h
+#define interleave_h
+
+// Interleaved lookups need C++20 coroutines: build with `make CXXSTD=c++20`.
+// Under C++14 this header defines nothing and LSM_COROUTINES stays unset.
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#define LSM_COROUTINES 1
+
+#include <coroutine>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+// A lookup written as a coroutine suspends wherever it is about to touch
+// memory that is likely not cached: it prefetches the address and hands the
+// thread back to its scheduler, which resumes another lookup in the meantime.
+// With enough lookups in flight the misses overlap instead of being paid one
+// after another.
+//
+// A LookupTask may co_await another (a tree lookup awaits the run lookups it
+// makes). The innermost suspended coroutine is recorded in the outermost
+// one's promise, which is what the scheduler resumes; a finishing coroutine
+// transfers straight back to the one awaiting it.
+template <class T>
+class LookupTask {
+public:
+    struct promise_type;
+    typedef coroutine_handle<promise_type> Handle;
+
+    struct promise_type {
+        T result;
+        coroutine_handle<> continuation; // the awaiting coroutine, or none for the outermost
+        coroutine_handle<> *leaf; // where the outermost coroutine keeps its innermost one
+        coroutine_handle<> root; // only used by the outermost coroutine
+
+        LookupTask get_return_object() {
+            return LookupTask(Handle::from_promise(*this));
+        }
+        suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept {
+                return false;
+            }
+            coroutine_handle<> await_suspend(Handle h) noexcept {
+                promise_type &p = h.promise();
+                if (!p.continuation) {
+                    return noop_coroutine();
+                }
+                *p.leaf = p.continuation;
+                return p.continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+        void return_value(const T &value) {
+            result = value;
+        }
+        void unhandled_exception() {
+            terminate();
+        }
+
+        // a scheduler starts and finishes frames at a high rate, so they are
+        // recycled per thread instead of going through malloc
+        static void *operator new(size_t size) {
+            return size <= FRAME_BYTES ? pool().get() : ::operator new(size);
+        }
+        static void operator delete(void *frame, size_t size) {
+            if (size <= FRAME_BYTES) {
+                pool().put(frame);
+            }
+            else {
+                ::operator delete(frame);
+            }
+        }
+    };
+
+    explicit LookupTask(Handle h): _h(h) {
+        _h.promise().root = _h;
+        _h.promise().leaf = &_h.promise().root;
+    }
+    LookupTask(LookupTask &&other): _h(other._h) {
+        other._h = Handle();
+    }
+    LookupTask &operator=(LookupTask &&other) {
+        if (this != &other) {
+            if (_h) {
+                _h.destroy();
+            }
+            _h = other._h;
+            other._h = Handle();
+        }
+        return *this;
+    }
+    LookupTask(const LookupTask &) = delete;
+    LookupTask &operator=(const LookupTask &) = delete;
+    ~LookupTask() {
+        if (_h) {
+            _h.destroy();
+        }
+    }
+
+    // for a scheduler driving an outermost task
+    void resume() {
+        _h.promise().leaf->resume();
+    }
+    bool done() const {
+        return _h.done();
+    }
+    const T &result() const {
+        return _h.promise().result;
+    }
+
+    // for a coroutine awaiting this task: run it until it suspends or
+    // finishes, and take its result once it has
+    bool await_ready() noexcept {
+        return false;
+    }
+    template <class P>
+    coroutine_handle<> await_suspend(coroutine_handle<P> awaiting) noexcept {
+        promise_type &p = _h.promise();
+        p.continuation = awaiting;
+        p.leaf = awaiting.promise().leaf;
+        *p.leaf = _h;
+        return _h;
+    }
+    T await_resume() {
+        return _h.promise().result;
+    }
+
+private:
+    static const size_t FRAME_BYTES = 512;
+
+    class FramePool {
+    public:
+        void *get() {
+            if (_free.empty()) {
+                return ::operator new(FRAME_BYTES);
+            }
+            void *frame = _free.back();
+            _free.pop_back();
+            return frame;
+        }
+        void put(void *frame) {
+            _free.push_back(frame);
+        }
+        ~FramePool() {
+            for (void *frame : _free) {
+                ::operator delete(frame);
+            }
+        }
+    private:
+        vector<void *> _free;
+    };
+    static FramePool &pool() {
+        static thread_local FramePool p;
+        return p;
+    }
+
+    Handle _h;
+};
+
+// co_await prefetchAndYield(p): start loading p and let the scheduler run
+// other lookups until it has likely arrived
+inline suspend_always prefetchAndYield(const void *addr) {
+    __builtin_prefetch(addr);
+    return suspend_always();
+}
+
+// What a lookup coroutine returns: whether the key was there and, if so, its value.
+template <class V>
+struct LookupResult {
+    bool found;
+    V value;
+};
+
+#endif /* coroutines */
+
+#endif /* interleave_h */
@@ -0,0 +1,196 @@
+//
+//  iterator.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef iterator_h
+#define iterator_h
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "run.hpp"
+#include "diskLevel.hpp"
+
+using namespace std;
+
+// Sorted scan over a set of runs, as of when the iterator was made. Every run
+// contributes a cursor (a skiplist cursor for buffer runs, an index into the
+// map for disk runs) and the cursors are merged through a min-heap keyed on
+// (key, age). When several runs hold a key, the newest one wins and the rest
+// are skipped; keys whose newest value is a tombstone are skipped entirely.
+// Each step costs O(log runs) and nothing is materialized.
+//
+//     for (it.Seek(lo); it.Valid() && it.key() < hi; it.Next()) ...
+//
+// The iterator holds references to its runs, so it stays usable after the
+// tree has merged them away. A merge that must carry tombstones down to the
+// next level builds one with skipTombstones false.
+template <class K, class V, class RunType, class FilterType>
+class MergingIterator {
+public:
+    typedef shared_ptr<DiskRun<K,V,FilterType>> DiskRunPtr;
+
+    // both lists are newest first, and every buffer run is newer than every disk run
+    MergingIterator(const vector<shared_ptr<Run<K,V>>> &memRuns, const vector<DiskRunPtr> &diskRuns, bool skipTombstones = true): _memRuns(memRuns), _diskRuns(diskRuns), _skipTombstones(skipTombstones), _valid(false) {
+        V_TOMBSTONE = (V) TOMBSTONE;
+        _sources.resize(memRuns.size() + diskRuns.size());
+        for (size_t i = 0; i < memRuns.size(); ++i) {
+            _sources[i].mem = static_cast<RunType *>(memRuns[i].get());
+        }
+        for (size_t i = 0; i < diskRuns.size(); ++i) {
+            _sources[memRuns.size() + i].disk = diskRuns[i].get();
+        }
+        _heap.reserve(_sources.size());
+    }
+
+    // position at the first live key >= key
+    void Seek(const K &key) {
+        _heap.clear();
+        for (int i = 0; i < (int) _sources.size(); ++i) {
+            Source &src = _sources[i];
+            if (src.mem != NULL) {
+                src.cursor = src.mem->seek(key);
+            }
+            else {
+                src.pos = src.disk->lower_bound(key);
+                src.end = src.disk->getCapacity();
+            }
+            push(i);
+        }
+        settle();
+    }
+
+    void SeekToFirst() {
+        _heap.clear();
+        for (int i = 0; i < (int) _sources.size(); ++i) {
+            Source &src = _sources[i];
+            if (src.mem != NULL) {
+                src.cursor = src.mem->begin();
+            }
+            else {
+                src.pos = 0;
+                src.end = src.disk->getCapacity();
+            }
+            push(i);
+        }
+        settle();
+    }
+
+    bool Valid() const {
+        return _valid;
+    }
+
+    // every cursor has already moved past the current key
+    void Next() {
+        settle();
+    }
+
+    const K &key() const {
+        return _key;
+    }
+
+    const V &value() const {
+        return _value;
+    }
+
+private:
+    struct Source {
+        RunType *mem = NULL;
+        typename RunType::Cursor cursor;
+        DiskRun<K,V,FilterType> *disk = NULL;
+        unsigned long pos = 0;
+        unsigned long end = 0;
+
+        bool valid() const {
+            return mem != NULL ? cursor.valid() : pos < end;
+        }
+        K key() const {
+            return mem != NULL ? cursor.key() : disk->map[pos].key;
+        }
+        V value() const {
+            return mem != NULL ? cursor.value() : disk->map[pos].value;
+        }
+        void next() {
+            if (mem != NULL) {
+                cursor.next();
+            }
+            else {
+                ++pos;
+            }
+        }
+    };
+
+    vector<shared_ptr<Run<K,V>>> _memRuns;
+    vector<DiskRunPtr> _diskRuns;
+    vector<Source> _sources; // index is age: lower is newer
+    vector<int> _heap;
+    V V_TOMBSTONE;
+    bool _skipTombstones;
+    bool _valid;
+    K _key;
+    V _value;
+
+    // std heap functions build a max-heap, so order "after" first
+    struct After {
+        const vector<Source> *sources;
+        bool operator()(int a, int b) const {
+            K ka = (*sources)[a].key(), kb = (*sources)[b].key();
+            return kb < ka || (ka == kb && b < a);
+        }
+    };
+
+    void push(int i) {
+        if (_sources[i].valid()) {
+            _heap.push_back(i);
+            push_heap(_heap.begin(), _heap.end(), After {&_sources});
+        }
+    }
+
+    // step the cursor on top of the heap
+    void advanceTop() {
+        pop_heap(_heap.begin(), _heap.end(), After {&_sources});
+        int i = _heap.back();
+        _heap.pop_back();
+        _sources[i].next();
+        push(i);
+    }
+
+    // take the smallest key from its newest run, move every cursor past it,
+    // and repeat while that value is a tombstone we are skipping
+    void settle() {
+        while (!_heap.empty()) {
+            const Source &top = _sources[_heap.front()];
+            K key = top.key();
+            V value = top.value();
+            while (!_heap.empty() && _sources[_heap.front()].key() == key) {
+                advanceTop();
+            }
+            if (!_skipTombstones || value != V_TOMBSTONE) {
+                _key = key;
+                _value = value;
+                _valid = true;
+                return;
+            }
+        }
+        _valid = false;
+    }
+};
+
+#endif /* iterator_h */
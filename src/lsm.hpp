@@ -28,8 +28,17 @@
 
 #include "run.hpp"
 #include "skipList.hpp"
+#include "concurrentSkipList.hpp"
 #include "bloom.hpp"
 #include "diskLevel.hpp"
+#include "wal.hpp"
+#include "manifest.hpp"
+#include "epoch.hpp"
+#include "iterator.hpp"
+#include "compaction.hpp"
+#include "rateLimiter.hpp"
+#include "tuner.hpp"
+#include "metrics.hpp"
 #include <cstdio>
 #include <cstdint>
 #include <cstring>
@@ -37,96 +46,331 @@
 #include <future>
 #include <vector>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
+#include <set>
+#include <deque>
+#include <condition_variable>
+#include <memory>
+#include <dirent.h>
 
-template <class K, class V>
+// Runtime knobs that do not change the shape of the tree. Everything here has
+// a default, so LSM(eltsPerRun, numRuns, ...) keeps its old behavior.
+struct LSMOptions {
+    string dataDir = "";                    // keep disk runs and a MANIFEST here across restarts; empty keeps
+                                            // runs in the working directory and deletes them on shutdown.
+                                            // Reopening a directory restores its tree, and the shape stored
+                                            // in its manifest overrides the constructor's parameters.
+    string walDir = "";                     // write-ahead log directory; empty disables the log. Without
+                                            // dataDir the disk runs do not survive a restart, so the log
+                                            // is the only durable copy: it is never truncated, and
+                                            // reopening replays everything ever inserted
+    WALSyncPolicy walSync = WAL_SYNC_NONE;
+    unsigned walSyncIntervalMs = 100;       // only for WAL_SYNC_INTERVAL
+    unsigned subcompactions = 1;            // threads that split each disk merge between them by key range;
+                                            // merges too small to be worth it always run on one thread
+    unsigned compactionThreads = 2;         // merges of different levels run side by side on this many
+                                            // threads; 0 runs every merge synchronously in the writer
+    unsigned maxFlushBatches = 2;           // full buffer batches that may wait to be flushed while the
+                                            // writer fills fresh runs; the writer blocks past this
+    size_t bufferMemoryLimit = 0;           // bytes the buffer and its waiting batches may hold together
+                                            // before the writer blocks; 0 is unlimited. One batch is
+                                            // always let through, so the buffer alone may exceed it
+    
+    // Write stalls. Merge debt is the number of pairs waiting to be merged
+    // down: queued buffer batches plus the runs of every full level. Past the
+    // slowdown threshold inserts are paced at slowdownWriteRate; past the
+    // stop threshold they wait for merges to bring the debt back under it.
+    // A threshold of 0 is never reached.
+    unsigned long slowdownMergeDebt = 0;
+    unsigned long stopMergeDebt = 0;
+    double slowdownWriteRate = 1000000;     // inserts per second while slowed down
+    double mergeWriteRate = 0;              // bytes per second all merges together may write; 0 is unlimited
+    size_t filterMemoryBudget = 0;          // bytes for all disk runs' Bloom filters, split between levels
+                                            // to minimize wasted run probes (see allocateFilterMemory);
+                                            // 0 gives every level the constructor's bf_fp
+    MergePolicy mergePolicy = TIERING;      // how disk levels take in merges (see diskLevel.hpp). A leveled
+                                            // level holds diskRunsPerLevel merges' worth of pairs in one
+                                            // run. LAZY_LEVELING levels the last level and tiers the rest
+    vector<MergePolicy> levelPolicies;      // per-level overrides of mergePolicy, level 1 first; levels
+                                            // past the end follow mergePolicy. Not LAZY_LEVELING
+    unsigned long autoTuneInterval = 0;     // operations between looks at the workload mix, after which the
+                                            // buffer's runs and merge fraction may be reshaped for it (see
+                                            // tuner.hpp); 0 keeps the constructor's shape
+    bool metrics = false;                   // count operations, filter outcomes, merge bytes, stalls and
+                                            // latencies per thread (see metrics.hpp and LSM::metrics)
+    RunBackend runBackend = MMAP_RUNS;      // how lookups read disk runs (see diskRun.hpp); PREAD_RUNS reads
+                                            // their pages through a block cache of blockCacheBytes
+    size_t blockCacheBytes = 64 << 20;
+};
+
+// RunType is the memory buffer's run implementation. With the default SkipList
+// only one thread may use the tree at a time. Instantiating with
+// ConcurrentSkipList makes the tree thread safe: any number of threads may
+// call insert_key/delete_key, and any number may call lookup/range alongside
+// them, without taking a lock.
+// FilterType is the Bloom filter used for both buffer and disk runs, either
+// BloomFilter or the cache-friendlier BlockedBloomFilter.
+template <class K, class V, class RunType = SkipList<K,V>, class FilterType = BloomFilter<K>>
 class LSM {
     
-    typedef SkipList<K,V> RunType;
+public:
+    V V_TOMBSTONE = (V) TOMBSTONE;
+    static const size_t MULTI_GET_BATCH = 64; // keys multi_get walks through the runs together
+#ifdef LSM_COROUTINES
+    static const unsigned INTERLEAVE_WIDTH = 16; // lookups interleaved_get keeps in flight
+    static const size_t INTERLEAVE_CHUNK = 4096; // keys looked up under one read view
+#endif
+    mutex *mergeLock; // guards the disk levels' run lists and the merge bookkeeping below
+    shared_timed_mutex *bufferLock; // shared by writers, exclusive to roll over runs
     
+    typedef MergingIterator<K,V,RunType,FilterType> Iterator;
     
+    vector<shared_ptr<Run<K,V>>> C_0;
     
-public:
-    V V_TOMBSTONE = (V) TOMBSTONE;
-    mutex *mergeLock;
+    vector<shared_ptr<FilterType>> filters;
+    vector<DiskLevel<K,V,FilterType> *> diskLevels;
     
-    vector<Run<K,V> *> C_0;
+    typedef typename DiskLevel<K,V,FilterType>::DiskRunPtr DiskRunPtr;
     
-    vector<BloomFilter<K> *> filters;
-    vector<DiskLevel<K,V> *> diskLevels;
+    // Everything a read looks at, all oldest first: the buffer runs, the runs
+    // waiting to be flushed, and every disk level's live runs. A view is never
+    // modified. Whoever changes the set of runs (do_merge, or a finished
+    // merge) builds a new view, swaps it in, and retires the old one
+    // through the epoch manager, so readers need no lock and the runs only
+    // the old view held are freed once no reader can be using them.
+    struct ReadView {
+        vector<shared_ptr<Run<K,V>>> buffer;
+        vector<shared_ptr<FilterType>> bufferFilters;
+        vector<shared_ptr<Run<K,V>>> flushing;
+        vector<shared_ptr<FilterType>> flushingFilters;
+        vector<vector<DiskRunPtr>> levels;
+    };
+    atomic<ReadView *> *_view;
+    mutex *viewLock; // serializes publishers, never taken by readers
     
-    LSM<K,V>(const LSM<K,V> &other) = default;
-    LSM<K,V>(LSM<K,V> &&other) = default;
+    LSM(const LSM &other) = default;
+    LSM(LSM &&other) = default;
     
-    LSM<K,V>(unsigned long eltsPerRun, unsigned int numRuns, double merged_frac, double bf_fp, unsigned int pageSize, unsigned int diskRunsPerLevel): _eltsPerRun(eltsPerRun), _num_runs(numRuns), _frac_runs_merged(merged_frac), _diskRunsPerLevel(diskRunsPerLevel), _num_to_merge(ceil(_frac_runs_merged * _num_runs)), _pageSize(pageSize){
+    LSM(unsigned long eltsPerRun, unsigned int numRuns, double merged_frac, double bf_fp, unsigned int pageSize, unsigned int diskRunsPerLevel, const LSMOptions &options = LSMOptions()): _options(options), _eltsPerRun(eltsPerRun), _num_runs(numRuns), _frac_runs_merged(merged_frac), _diskRunsPerLevel(diskRunsPerLevel), _num_to_merge(ceil(_frac_runs_merged * _num_runs)), _pageSize(pageSize){
         _activeRun = 0;
         _bfFalsePositiveRate = bf_fp;
         _n = 0;
+        _blockCache = _options.runBackend == PREAD_RUNS ? new BlockCache(_options.blockCacheBytes) : NULL;
         
+        if (!_options.dataDir.empty()){
+            if (mkdir(_options.dataDir.c_str(), 0700) == -1 && errno != EEXIST) {
+                perror(("Error creating data directory " + _options.dataDir).c_str());
+                exit(EXIT_FAILURE);
+            }
+            Manifest<K> manifest;
+            if (manifest.load(_options.dataDir)){
+                openFromManifest(manifest);
+            }
+        }
         
-        DiskLevel<K,V> * diskLevel = new DiskLevel<K, V>(pageSize, 1, _num_to_merge * _eltsPerRun, _diskRunsPerLevel, ceil(_diskRunsPerLevel * _frac_runs_merged), _bfFalsePositiveRate);
-        
-        diskLevels.push_back(diskLevel);
-        _numDiskLevels = 1;
+        // level 1 is built for batches this large; retuning never exceeds it
+        _flushSize = _num_to_merge * _eltsPerRun;
+        _tuner = _options.autoTuneInterval == 0 ? NULL : new AutoTuner(_num_runs * _eltsPerRun, _flushSize, _options.autoTuneInterval);
+        _metrics = _options.metrics ? new Metrics() : NULL;
+        if (diskLevels.empty()){
+            _numDiskLevels = 0;
+            addDiskLevel();
+        }
         
         
         for (int i = 0; i < _num_runs; i++){
             RunType * run = new RunType(INT32_MIN,INT32_MAX);
             run->set_size(_eltsPerRun);
-            C_0.push_back(run);
+            C_0.push_back(shared_ptr<Run<K,V>>(run));
             
-            BloomFilter<K> * bf = new BloomFilter<K>(_eltsPerRun, _bfFalsePositiveRate);
-            filters.push_back(bf);
+            FilterType * bf = new FilterType(_eltsPerRun, _bfFalsePositiveRate);
+            filters.push_back(shared_ptr<FilterType>(bf));
         }
+        allocateFilterMemory();
         mergeLock = new mutex();
+        bufferLock = new shared_timed_mutex();
+        viewLock = new mutex();
+        _mergeDone = new condition_variable();
+        _mergeDebt = new atomic<unsigned long>(0);
+        _mergeLimiter = new RateLimiter(_options.mergeWriteRate, _options.mergeWriteRate / 10);
+        _writeLimiter = new RateLimiter(_options.slowdownWriteRate, _options.slowdownWriteRate / 1000);
+        _levelBusy = vector<bool>(_numDiskLevels, false);
+        _compactions = new CompactionScheduler(_options.compactionThreads);
+        
+        if (!_options.dataDir.empty()){
+            saveManifest();
+            purgeObsoleteFiles();
+        }
+        ReadView *view = new ReadView();
+        view->buffer = C_0;
+        view->bufferFilters = filters;
+        for (int i = 0; i < _numDiskLevels; ++i){
+            view->levels.push_back(diskLevels[i]->liveRuns());
+        }
+        _view = new atomic<ReadView *>(view);
+        
+        // a reopened tree may have full levels to merge down
+        vector<function<void()>> ready;
+        {
+            lock_guard<mutex> l(*mergeLock);
+            ready = readyMerges();
+            updateMergeDebt();
+        }
+        submitMerges(ready);
+        
+        _wal = NULL;
+        _walStripes = NULL;
+        if (!_options.walDir.empty()){
+            _walStripes = new mutex[WAL_STRIPES];
+            _wal = new WriteAheadLog<K,V>(_options.walDir, _options.walSync, _options.walSyncIntervalMs);
+            _walSegments = vector<uint64_t>(_num_runs, 0);
+            _walSegments[0] = _wal->current_segment();
+            // rebuild the buffer from whatever a previous process logged but never flushed
+            _wal->replay([this](K key, V value){ insert_key(key, value); });
+        }
     }
-    ~LSM<K,V>(){
-        if (mergeThread.joinable()){
-            mergeThread.join();
+    ~LSM(){
+        if (!_options.dataDir.empty()){
+            flush_buffer();
         }
+        waitForMerges();
+        delete _compactions;
+        delete _mergeDone;
+        delete _mergeDebt;
+        delete _mergeLimiter;
+        delete _writeLimiter;
+        delete _tuner;
+        delete _metrics;
+        delete _wal;
+        delete [] _walStripes;
         delete mergeLock;
-        for (int i = 0; i < C_0.size(); ++i){
-            delete C_0[i];
-            delete filters[i];
-        }
+        delete bufferLock;
+        // no reader may be running now; drop our view and whatever older ones are retired
+        delete _view->load();
+        delete _view;
+        delete viewLock;
+        EpochManager::instance().reclaim();
         for (int i = 0; i < diskLevels.size(); ++i){
             delete diskLevels[i];
         }
-        
+        delete _blockCache;
     }
     
     void insert_key(K &key, V &value) {
-        if (C_0[_activeRun]->num_elements() >= _eltsPerRun){
-            ++_activeRun;
+        if (_tuner){
+            _tuner->countInsert();
         }
-        
-        if (_activeRun >= _num_runs){
-            do_merge();
+        if (!_metrics){
+            insert_key(key, value, integral_constant<bool, RunType::concurrent>());
+            return;
+        }
+        Metrics::Shard &m = _metrics->local();
+        bool timed = m.sample();
+        uint64_t started = timed ? Metrics::now() : 0;
+        insert_key(key, value, integral_constant<bool, RunType::concurrent>());
+        m.add(Metrics::INSERTS);
+        m.add(Metrics::BYTES_INSERTED, sizeof(KVPair<K,V>));
+        if (timed){
+            m.record(Metrics::INSERT_LATENCY, Metrics::now() - started);
+        }
+    }
+    
+    void insert_key(K &key, V &value, false_type /* single writer */) {
+        throttle();
+        if (C_0[_activeRun]->num_elements() >= _eltsPerRun){
+            roll_over_run();
         }
         
+        uint64_t lsn = _wal ? _wal->append(key, value) : 0;
         C_0[_activeRun]->insert_key(key,value);
         filters[_activeRun]->add(&key, sizeof(K));
+        if (_wal){
+            _wal->commit(lsn);
+        }
     }
     
-    bool lookup(K &key, V &value){
-        bool found = false;
-        for (int i = _activeRun; i >= 0; --i){
-            if (key < C_0[i]->get_min() || key > C_0[i]->get_max() || !filters[i]->mayContain(&key, sizeof(K)))
-                continue;
+    void insert_key(K &key, V &value, true_type /* concurrent writers */) {
+        // writers only share the active run; rolling over to the next run (and
+        // kicking off a merge when the buffer is full) takes the lock exclusively
+        throttle();
+        while (true) {
+            bufferLock->lock_shared();
+            unsigned int run = _activeRun;
+            if (!_wal){
+                if (static_cast<RunType *>(C_0[run].get())->insert_key_bounded(key, value)){
+                    filters[run]->addConcurrent(&key, sizeof(K));
+                    bufferLock->unlock_shared();
+                    return;
+                }
+                bufferLock->unlock_shared();
+            }
+            else {
+                // Logged under the shared lock so the record lands in its run's
+                // segment, and under the key's stripe so that writers of one key
+                // log in the order their values land in the run. A record logged
+                // for a full run is logged again with the retry, which replays
+                // the same.
+                mutex &stripe = _walStripes[hash<K>()(key) % WAL_STRIPES];
+                stripe.lock();
+                uint64_t lsn = _wal->append(key, value);
+                bool inserted = static_cast<RunType *>(C_0[run].get())->insert_key_bounded(key, value);
+                stripe.unlock();
+                if (inserted){
+                    filters[run]->addConcurrent(&key, sizeof(K));
+                }
+                bufferLock->unlock_shared();
+                if (inserted){
+                    _wal->commit(lsn);
+                    return;
+                }
+            }
             
-            value = C_0[i]->lookup(key, found);
-            if (found) {
-                return value != V_TOMBSTONE;
+            bufferLock->lock();
+            if (C_0[_activeRun]->num_elements() >= _eltsPerRun){
+                roll_over_run();
             }
+            bufferLock->unlock();
+        }
+    }
+    
+    bool lookup(K &key, V &value){
+        if (_tuner){
+            _tuner->countLookup();
+        }
+        if (!_metrics){
+            return find(key, value, NULL);
+        }
+        Metrics::Shard &m = _metrics->local();
+        bool timed = m.sample();
+        uint64_t started = timed ? Metrics::now() : 0;
+        bool found = find(key, value, &m);
+        m.add(Metrics::LOOKUPS);
+        if (found){
+            m.add(Metrics::LOOKUP_HITS);
         }
-        if (mergeThread.joinable()){
-            // make sure that there isn't a merge happening as you search the disk
-            mergeThread.join();
+        if (timed){
+            m.record(Metrics::LOOKUP_LATENCY, Metrics::now() - started);
+        }
+        return found;
+    }
+    
+    bool find(K &key, V &value, Metrics::Shard *metrics){
+        bool found = false;
+        // hash once; every buffer and disk filter probe reuses it
+        auto keyHash = FilterType::hash(&key, sizeof(K));
+        EpochGuard guard;
+        const ReadView *view = _view->load(memory_order_acquire);
+        // merges may be running; the runs they were handed and the disk levels
+        // as they were before them stay in the view until they publish
+        if (lookupMemory(view->buffer, view->bufferFilters, key, keyHash, value) ||
+            lookupMemory(view->flushing, view->flushingFilters, key, keyHash, value)){
+            return value != V_TOMBSTONE;
         }
         // it's not in C_0 so let's look at disk.
-        for (int i = 0; i < _numDiskLevels; i++){
+        for (int i = 0; i < view->levels.size(); i++){
             
-            value = diskLevels[i]->lookup(key, found);
+            value = DiskLevel<K,V,FilterType>::lookupRuns(view->levels[i], (unsigned) view->levels[i].size(), key, keyHash, found, metrics, i);
             if (found) {
                 return value != V_TOMBSTONE;
             }
@@ -134,65 +378,135 @@ public:
         return false;
     }
     
+    // Look up n keys at once: found[i] says whether keys[i] is live and, if
+    // so, out[i] holds its value. Keys go through each run together, one
+    // stage at a time -- prefetch every filter block, probe the filters and
+    // start loading the pages of the runs that may hold them, then search the
+    // pages -- so the cache misses of one key overlap with those of the rest
+    // of its batch instead of being paid one after another.
+    void multi_get(const K *keys, size_t n, V *out, bool *found){
+        if (_tuner){
+            _tuner->countLookup(n);
+        }
+        Metrics::Shard *metrics = _metrics ? &_metrics->local() : NULL;
+        for (size_t i = 0; i < n; i += MULTI_GET_BATCH){
+            multiGetBatch(keys + i, min(n - i, MULTI_GET_BATCH), out + i, found + i, metrics);
+        }
+        if (metrics){
+            metrics->add(Metrics::LOOKUPS, n);
+            metrics->add(Metrics::LOOKUP_HITS, count(found, found + n, true));
+        }
+    }
+    
+#ifdef LSM_COROUTINES
+    // Look up n keys as multi_get does, but with each lookup written as a
+    // coroutine that yields wherever it is about to miss the cache (a disk
+    // run's filter, a skiplist node, a cache line of a mapped page); width of
+    // them are in flight at a time, resumed round robin, so one lookup's
+    // misses are hidden behind the others' work. Needs a C++20 build.
+    void interleaved_get(const K *keys, size_t n, V *out, bool *found, unsigned width = INTERLEAVE_WIDTH){
+        if (_tuner){
+            _tuner->countLookup(n);
+        }
+        Metrics::Shard *metrics = _metrics ? &_metrics->local() : NULL;
+        width = max(width, 1u);
+        vector<LookupTask<LookupResult<V>>> tasks;
+        vector<size_t> taskKeys;
+        tasks.reserve(width);
+        taskKeys.reserve(width);
+        for (size_t chunk = 0; chunk < n; chunk += INTERLEAVE_CHUNK){
+            size_t chunkEnd = min(n, chunk + INTERLEAVE_CHUNK);
+            EpochGuard guard;
+            const ReadView *view = _view->load(memory_order_acquire);
+            size_t next = chunk;
+            while (next < chunkEnd && tasks.size() < width){
+                tasks.push_back(findTask(view, keys[next], metrics));
+                taskKeys.push_back(next++);
+            }
+            while (!tasks.empty()){
+                for (size_t t = 0; t < tasks.size(); ){
+                    tasks[t].resume();
+                    if (!tasks[t].done()){
+                        t++;
+                        continue;
+                    }
+                    LookupResult<V> res = tasks[t].result();
+                    found[taskKeys[t]] = res.found;
+                    out[taskKeys[t]] = res.value;
+                    if (next < chunkEnd){
+                        tasks[t] = findTask(view, keys[next], metrics);
+                        taskKeys[t++] = next++;
+                    }
+                    else {
+                        tasks[t] = move(tasks.back());
+                        taskKeys[t] = taskKeys.back();
+                        tasks.pop_back();
+                        taskKeys.pop_back();
+                    }
+                }
+            }
+        }
+        if (metrics){
+            metrics->add(Metrics::LOOKUPS, n);
+            metrics->add(Metrics::LOOKUP_HITS, count(found, found + n, true));
+        }
+    }
+#endif
+    
+    // the tree's counters and latency histograms, or NULL if options.metrics
+    // is off; see Metrics::snapshot and Metrics::toJSON
+    Metrics *metrics(){
+        return _metrics;
+    }
+    
+    // the cache disk runs are read through, or NULL with MMAP_RUNS
+    BlockCache *blockCache(){
+        return _blockCache;
+    }
+    
     void delete_key(K &key){
         insert_key(key, V_TOMBSTONE);
     }
     
+    // the live elements with key1 <= key < key2, in key order
     vector<KVPair<K,V>> range(K &key1, K &key2){
         if (key2 <= key1){
             return (vector<KVPair<K,V>> {});
         }
-        auto ht = HashTable<K, V>(4096 * 1000);
-        
-        vector<KVPair<K,V>> eltsInRange = vector<KVPair<K,V>>();
-
-        
-        for (int i = _activeRun; i >= 0; --i){
-            vector<KVPair<K,V>> cur_elts = C_0[i]->get_all_in_range(key1, key2);
-            if (cur_elts.size() != 0){
-                eltsInRange.reserve(eltsInRange.size() + cur_elts.size()); //this over-reserves to be safe
-                for (int c = 0; c < cur_elts.size(); c++){
-                    V dummy = ht.putIfEmpty(cur_elts[c].key, cur_elts[c].value);
-                    if (!dummy && cur_elts[c].value != V_TOMBSTONE){
-                        eltsInRange.push_back(cur_elts[c]);
-                    }
-                    
-                }
-            }
-            
+        if (_tuner){
+            _tuner->countRange();
         }
-        
-        if (mergeThread.joinable()){
-            // make sure that there isn't a merge happening as you search the disk
-            mergeThread.join();
+        uint64_t started = _metrics ? Metrics::now() : 0; // ranges are slow enough to time every one
+        vector<KVPair<K,V>> eltsInRange = vector<KVPair<K,V>>();
+        Iterator it = get_iterator();
+        for (it.Seek(key1); it.Valid() && it.key() < key2; it.Next()){
+            KVPair<K,V> kv = {it.key(), it.value()};
+            eltsInRange.push_back(kv);
         }
-        
-        for (int j = 0; j < _numDiskLevels; j++){
-            for (int r = diskLevels[j]->_activeRun - 1; r >= 0 ; --r){
-                unsigned long i1, i2;
-                diskLevels[j]->runs[r]->range(key1, key2, i1, i2);
-                if (i2 - i1 != 0){
-                    auto oldSize = eltsInRange.size();
-                    eltsInRange.reserve(oldSize + (i2 - i1)); // also over-reserves space
-                    for (unsigned long m = i1; m < i2; ++m){
-                        auto KV = diskLevels[j]->runs[r]->map[m];
-                        V dummy = ht.putIfEmpty(KV.key, KV.value);
-                        if (!dummy && KV.value != V_TOMBSTONE) {
-                            eltsInRange.push_back(KV);
-                        }
-                    }
-                }
-            }
+        if (_metrics){
+            _metrics->add(Metrics::RANGES);
+            _metrics->record(Metrics::RANGE_LATENCY, Metrics::now() - started);
         }
-        
         return eltsInRange;
     }
     
-    
+    // A sorted, deduplicated scan over every run that exists right now (see
+    // iterator.hpp). Inserts made after this call may or may not show up.
+    Iterator get_iterator(){
+        EpochGuard guard;
+        const ReadView *view = _view->load(memory_order_acquire);
+        vector<shared_ptr<Run<K,V>>> memRuns;
+        vector<DiskRunPtr> diskRuns;
+        memRuns.insert(memRuns.end(), view->buffer.rbegin(), view->buffer.rend());
+        memRuns.insert(memRuns.end(), view->flushing.rbegin(), view->flushing.rend());
+        for (int j = 0; j < view->levels.size(); j++){
+            diskRuns.insert(diskRuns.end(), view->levels[j].rbegin(), view->levels[j].rend());
+        }
+        return Iterator(memRuns, diskRuns);
+    }
     
     void printElts(){
-        if (mergeThread.joinable())
-            mergeThread.join();
+        waitForMerges();
         cout << "MEMORY BUFFER" << endl;
         for (int i = 0; i <= _activeRun; i++){
             cout << "MEMORY BUFFER RUN " << i << endl;
@@ -230,6 +544,7 @@ public:
     }
     
     //private: // TODO MAKE PRIVATE
+    LSMOptions _options;
     unsigned int _activeRun;
     unsigned long _eltsPerRun;
     double _bfFalsePositiveRate;
@@ -240,70 +555,336 @@ public:
     unsigned int _num_to_merge;
     unsigned int _pageSize;
     unsigned long _n;
-    thread mergeThread;
+    unsigned long _flushSize; // most pairs a flush may carry into level 1
+    AutoTuner *_tuner;
+    Metrics *_metrics;
+    BlockCache *_blockCache; // NULL unless options.runBackend is PREAD_RUNS
     
-    void mergeRunsToLevel(int level) {
-        bool isLast = false;
-        
-        if (level == _numDiskLevels){ // if this is the last level
-            DiskLevel<K,V> * newLevel = new DiskLevel<K, V>(_pageSize, level + 1, diskLevels[level - 1]->_runSize * diskLevels[level - 1]->_mergeSize, _diskRunsPerLevel, ceil(_diskRunsPerLevel * _frac_runs_merged), _bfFalsePositiveRate);
-            diskLevels.push_back(newLevel);
-            _numDiskLevels++;
+    // A batch of buffer runs rotated out by do_merge. It stays queued until
+    // it has been merged into level 1, and its runs stay in the view as
+    // flushing until then.
+    struct FlushBatch {
+        vector<shared_ptr<Run<K,V>>> runs;
+        vector<shared_ptr<FilterType>> filters;
+        uint64_t lastSegment; // newest log segment holding its records
+        size_t bytes; // memory held by its runs and filters
+    };
+    CompactionScheduler *_compactions;
+    deque<FlushBatch> _flushQueue;
+    condition_variable *_mergeDone; // a merge committed; waited on with mergeLock
+    atomic<unsigned long> *_mergeDebt; // see LSMOptions; written under mergeLock
+    RateLimiter *_mergeLimiter;
+    RateLimiter *_writeLimiter; // paces inserts past the slowdown threshold
+    vector<bool> _levelBusy; // _levelBusy[i]: a merge is writing into diskLevels[i]
+    WriteAheadLog<K,V> *_wal;
+    static const unsigned WAL_STRIPES = 64;
+    mutex *_walStripes; // concurrent writers of a key log and insert under its stripe
+    vector<uint64_t> _walSegments; // log segment holding each buffer run's records
+    
+    // Merges form a chain: the flush of a buffer batch writes into level 1,
+    // and the merge out of level i - 1 writes into level i. A merge needs
+    // room in its target and, for a disk level, a full source, so
+    // the merges into two adjacent levels never overlap, while those into
+    // levels further apart (a flush and a 2->3 merge, say) run side by side.
+    // Each merge does its heavy work without locks and then commits under
+    // mergeLock: the run counts change, the manifest is saved, the view is
+    // republished, and whatever merges that made ready are submitted.
+    //
+    // Returns the merges that can start now and marks their targets busy;
+    // caller holds mergeLock and passes the result to submitMerges after
+    // letting go of it.
+    vector<function<void()>> readyMerges(){
+        vector<function<void()>> ready;
+        if (!_flushQueue.empty() && !_levelBusy[0] && !diskLevels[0]->levelFull()){
+            _levelBusy[0] = true;
+            DiskLevel<K,V,FilterType> *to = diskLevels[0];
+            to->prepareOutput();
+            vector<DiskRunPtr> levelRuns = to->mergeTargets();
+            bool isLast = mergesWholeTree(0);
+            ready.push_back([this, to, levelRuns, isLast]{ flushTask(to, levelRuns, isLast); });
         }
-        
-        if (diskLevels[level]->levelFull()) {
-            mergeRunsToLevel(level + 1); // merge down one, recursively
+        for (int level = 1; level <= _numDiskLevels; level++){
+            if (!diskLevels[level - 1]->levelFull()){
+                continue;
+            }
+            if (level == _numDiskLevels){ // merging out of the last level
+                addDiskLevel();
+                _levelBusy.push_back(false);
+            }
+            if (_levelBusy[level] || diskLevels[level]->levelFull()){
+                continue; // a full target is merged down first
+            }
+            bool isLast = mergesWholeTree(level);
+            _levelBusy[level] = true;
+            DiskLevel<K,V,FilterType> *from = diskLevels[level - 1], *to = diskLevels[level];
+            to->prepareOutput();
+            vector<DiskRunPtr> runsToMerge = to->mergeTargets(), fromRuns = from->getRunsToMerge();
+            runsToMerge.insert(runsToMerge.end(), fromRuns.begin(), fromRuns.end());
+            ready.push_back([this, level, from, to, runsToMerge, fromRuns, isLast]{ mergeTask(level, from, to, runsToMerge, fromRuns, isLast); });
         }
-        
-        if(level + 1 == _numDiskLevels && diskLevels[level]->levelEmpty()){
-            isLast = true;
+        return ready;
+    }
+    
+    // Tombstones can go in a merge into diskLevels[index] once nothing older
+    // than them is left: no level below, and nothing in the target that the
+    // merge does not read. Caller holds mergeLock.
+    bool mergesWholeTree(int index){
+        DiskLevel<K,V,FilterType> *to = diskLevels[index];
+        return index + 1 == _numDiskLevels && (to->levelEmpty() || to->_policy == LEVELING);
+    }
+    
+    // the policy diskLevels[index] should have with the tree as deep as it is now
+    MergePolicy policyFor(int index){
+        if (index < _options.levelPolicies.size()){
+            return _options.levelPolicies[index];
         }
+        if (_options.mergePolicy == LAZY_LEVELING){
+            return index + 1 == _numDiskLevels ? LEVELING : TIERING;
+        }
+        return _options.mergePolicy;
+    }
+    
+    // Level shapes. A tiered level has diskRunsPerLevel runs as long as one
+    // merge into it and merges merged_frac of them down at a time. A leveled
+    // level has one run with room for diskRunsPerLevel merges, so both hold
+    // the same number of pairs when full.
+    unsigned levelRatio(MergePolicy policy){
+        return policy == LEVELING ? _diskRunsPerLevel : 1;
+    }
+    unsigned levelRuns(MergePolicy policy){
+        return policy == LEVELING ? 1 : _diskRunsPerLevel;
+    }
+    unsigned levelMergeSize(MergePolicy policy){
+        return policy == LEVELING ? 1 : ceil(_diskRunsPerLevel * _frac_runs_merged);
+    }
+    
+    // most pairs one merge into diskLevels[index] brings
+    unsigned long incomingSize(int index){
+        return index == 0 ? _flushSize : diskLevels[index - 1]->outgoingSize();
+    }
+    
+    // append a level below the last one; caller holds mergeLock or is the
+    // constructor
+    void addDiskLevel(){
+        int index = _numDiskLevels++;
+        MergePolicy policy = policyFor(index);
+        diskLevels.push_back(new DiskLevel<K,V,FilterType>(_pageSize, index + 1, incomingSize(index) * levelRatio(policy), levelRuns(policy), levelMergeSize(policy), _bfFalsePositiveRate, _options.dataDir, policy, _diskRunsPerLevel, _blockCache));
+    }
+    
+    void submitMerges(const vector<function<void()>> &ready){
+        for (int i = 0; i < ready.size(); i++){
+            _compactions->submit(ready[i]);
+        }
+    }
+    
+    // Merge the runs handed out at dispatch into `to`: fromRuns, and before
+    // them whatever `to` merges with (see DiskLevel::mergeTargets).
+    void mergeTask(int level, DiskLevel<K,V,FilterType> *from, DiskLevel<K,V,FilterType> *to, vector<DiskRunPtr> runsToMerge, vector<DiskRunPtr> fromRuns, bool isLast){
+        unsigned long n = to->addRuns(runsToMerge, isLast, _options.subcompactions, _mergeLimiter, _metrics);
         
-        
-        vector<DiskRun<K, V> *> runsToMerge = diskLevels[level - 1]->getRunsToMerge();
-        unsigned long runLen = diskLevels[level - 1]->_runSize;
-        diskLevels[level]->addRuns(runsToMerge, runLen, isLast);
-        diskLevels[level - 1]->freeMergedRuns(runsToMerge);
-        
-
-        
-        
-        
+        unique_lock<mutex> l(*mergeLock);
+        to->commitRun(n);
+        from->freeMergedRuns(fromRuns);
+        if (from->levelEmpty() && from->_policy != policyFor(level - 1)){
+            // lazy leveling: the old last level has a level below it now
+            from->reshape(policyFor(level - 1), incomingSize(level - 1) * levelRatio(policyFor(level - 1)), levelRuns(policyFor(level - 1)), levelMergeSize(policyFor(level - 1)), _diskRunsPerLevel);
+        }
+        publishMerge();
+        startNextMerges(level, l);
     }
-    void merge_runs(vector<Run<K,V>*> runs_to_merge, vector<BloomFilter<K>*> bf_to_merge){
-        vector<KVPair<K, V>> to_merge = vector<KVPair<K,V>>();
-        to_merge.reserve(_eltsPerRun * _num_to_merge);
-        for (int i = 0; i < runs_to_merge.size(); i++){
-            auto all = (runs_to_merge)[i]->get_all();
-            
-            to_merge.insert(to_merge.begin(), all.begin(), all.end());
-            delete (runs_to_merge)[i];
-            delete (bf_to_merge)[i];
+    
+    // merge the oldest queued buffer batch into level 1 (`to`, taken under
+    // mergeLock at dispatch, since diskLevels may grow meanwhile), along with
+    // the level's own runs if it is leveled
+    void flushTask(DiskLevel<K,V,FilterType> *to, vector<DiskRunPtr> levelRuns, bool isLast){
+        FlushBatch batch;
+        {
+            lock_guard<mutex> l(*mergeLock);
+            batch = _flushQueue.front();
         }
-        sort(to_merge.begin(), to_merge.end());
-        mergeLock->lock();
-        if (diskLevels[0]->levelFull()){
-            mergeRunsToLevel(1);
+        unsigned long n = merge_runs(to, batch.runs, levelRuns, isLast);
+        bool releaseLog = _wal && !_options.dataDir.empty();
+        if (releaseLog && n > 0){
+            to->activeRun()->sync(); // before the log segments go
         }
-        diskLevels[0]->addRunByArray(&to_merge[0], to_merge.size());
-        mergeLock->unlock();
         
+        unique_lock<mutex> l(*mergeLock);
+        to->commitRun(n);
+        _flushQueue.pop_front();
+        publishMerge();
+        if (releaseLog){
+            // the flushed runs are safe on disk, so their log segments can go;
+            // batches commit in order, so the segments are released in order
+            _wal->release(batch.lastSegment);
+        }
+        startNextMerges(0, l);
+    }
+    
+    // a merge just committed its runs; caller holds mergeLock
+    void publishMerge(){
+        allocateFilterMemory();
+        if (!_options.dataDir.empty()){
+            // the new runs are synced; publish them, then drop the files they replace
+            saveManifest();
+            purgeObsoleteFiles();
+        }
+        publishLevels();
+    }
+    
+    // free the level a merge wrote into and start whatever that unblocked;
+    // l holds mergeLock, which is let go of while submitting
+    void startNextMerges(int level, unique_lock<mutex> &l){
+        _levelBusy[level] = false;
+        vector<function<void()>> ready = readyMerges();
+        updateMergeDebt();
+        _mergeDone->notify_all();
+        l.unlock();
+        submitMerges(ready);
+    }
+    
+    // k-way merge of a batch of (already sorted) buffer runs, and of the
+    // level 1 runs in levelRuns, straight into level 1's (`to`'s) active run, which it
+    // seals but leaves uncommitted. The runs are oldest first, so a key's
+    // value comes from the last run that has it. Tombstones are kept for the
+    // levels below unless isLast.
+    unsigned long merge_runs(DiskLevel<K,V,FilterType> *to, const vector<shared_ptr<Run<K,V>>> &runs_to_merge, const vector<DiskRunPtr> &levelRuns, bool isLast){
+        uint64_t started = _metrics ? Metrics::now() : 0;
+        Iterator it(vector<shared_ptr<Run<K,V>>>(runs_to_merge.rbegin(), runs_to_merge.rend()), vector<DiskRunPtr>(levelRuns.rbegin(), levelRuns.rend()), isLast);
+        KVPair<K,V> *out = to->activeRunMap();
+        unsigned long n = 0;
+        for (it.SeekToFirst(); it.Valid(); it.Next()){
+            out[n].key = it.key();
+            out[n].value = it.value();
+            if (++n % BlockReader<K,V>::BLOCK == 0){
+                _mergeLimiter->request(BlockReader<K,V>::BLOCK * sizeof(KVPair<K,V>));
+            }
+        }
+        to->sealRun(n);
+        if (_metrics){
+            _metrics->add(Metrics::BYTES_FLUSHED, n * sizeof(KVPair<K,V>));
+            _metrics->record(Metrics::FLUSH_LATENCY, Metrics::now() - started);
+        }
+        return n;
+    }
+    
+    // queue a batch for level 1; readers see its runs as flushing from now on
+    void enqueueFlush(const vector<shared_ptr<Run<K,V>>> &runs, const vector<shared_ptr<FilterType>> &bfs, uint64_t lastSegment, size_t bytes){
+        vector<function<void()>> ready;
+        {
+            lock_guard<mutex> l(*mergeLock);
+            _flushQueue.push_back(FlushBatch {runs, bfs, lastSegment, bytes});
+            publishBuffer();
+            ready = readyMerges();
+            updateMergeDebt();
+        }
+        submitMerges(ready);
+    }
+    
+    static size_t runBytes(const shared_ptr<Run<K,V>> &run, const shared_ptr<FilterType> &bf){
+        return static_cast<RunType *>(run.get())->get_memory_bytes() + bf->dataBytes();
+    }
+    
+    // memory held by batches waiting to flush; caller holds mergeLock
+    size_t flushingBytes(){
+        size_t total = 0;
+        for (int i = 0; i < _flushQueue.size(); ++i){
+            total += _flushQueue[i].bytes;
+        }
+        return total;
+    }
+    
+    // caller holds mergeLock
+    void updateMergeDebt(){
+        unsigned long debt = 0;
+        for (int i = 0; i < _flushQueue.size(); ++i){
+            for (int r = 0; r < _flushQueue[i].runs.size(); ++r){
+                debt += _flushQueue[i].runs[r]->num_elements();
+            }
+        }
+        for (int i = 0; i < _numDiskLevels; ++i){
+            if (diskLevels[i]->levelFull()){
+                debt += diskLevels[i]->num_elements();
+            }
+        }
+        _mergeDebt->store(debt, memory_order_relaxed);
+    }
+    
+    // backpressure on writers, before they touch the buffer; see LSMOptions
+    void throttle(){
+        unsigned long debt = _mergeDebt->load(memory_order_relaxed);
+        if (_options.stopMergeDebt != 0 && debt >= _options.stopMergeDebt){
+            uint64_t started = Metrics::now();
+            {
+                unique_lock<mutex> l(*mergeLock);
+                _mergeDone->wait(l, [this]{ return _mergeDebt->load(memory_order_relaxed) < _options.stopMergeDebt; });
+            }
+            countStall(started);
+        }
+        else if (_options.slowdownMergeDebt != 0 && debt >= _options.slowdownMergeDebt){
+            uint64_t started = Metrics::now();
+            _writeLimiter->request(1);
+            countStall(started);
+        }
+    }
+    
+    void countStall(uint64_t started){
+        if (_metrics){
+            _metrics->add(Metrics::STALLS);
+            _metrics->add(Metrics::STALL_NANOS, Metrics::now() - started);
+        }
+    }
+    
+    // block until no merge is queued or running
+    void waitForMerges(){
+        _compactions->waitIdle();
+    }
+    
+    // caller has exclusive access to the buffer
+    void roll_over_run(){
+        ++_activeRun;
+        if (_activeRun >= _num_runs){
+            do_merge();
+        }
+        else if (_wal){
+            _walSegments[_activeRun] = _wal->rotate();
+        }
     }
     
     void do_merge(){
         if (_num_to_merge == 0)
             return;
-        vector<Run<K,V>*> runs_to_merge = vector<Run<K,V>*>();
-        vector<BloomFilter<K>*> bf_to_merge = vector<BloomFilter<K>*>();
-        for (int i = 0; i < _num_to_merge; i++){
-            runs_to_merge.push_back(C_0[i]);
-            bf_to_merge.push_back(filters[i]);
+        if (_tuner){
+            BufferShape current = {_num_runs, _eltsPerRun, _frac_runs_merged};
+            unsigned long diskElts = 0;
+            {
+                lock_guard<mutex> l(*mergeLock);
+                for (int i = 0; i < _numDiskLevels; ++i){
+                    diskElts += diskLevels[i]->num_elements();
+                }
+            }
+            BufferShape next = _tuner->retune(current, diskElts, _diskRunsPerLevel);
+            if (!(next == current)){
+                reshapeBuffer(next);
+                return;
+            }
+        }
+        vector<shared_ptr<Run<K,V>>> runs_to_merge(C_0.begin(), C_0.begin() + _num_to_merge);
+        vector<shared_ptr<FilterType>> bf_to_merge(filters.begin(), filters.begin() + _num_to_merge);
+        size_t bufferBytes = 0, batchBytes = 0;
+        for (int i = 0; i < _num_runs; i++){
+            size_t bytes = runBytes(C_0[i], filters[i]);
+            bufferBytes += bytes;
+            batchBytes += i < _num_to_merge ? bytes : 0;
         }
-        if (mergeThread.joinable()){
-            mergeThread.join();
+        waitForFlushRoom(bufferBytes);
+        uint64_t lastSegment = 0;
+        if (_wal){
+            // move the log on before the merge can release the flushed runs' segments
+            lastSegment = _walSegments[_num_to_merge - 1];
+            _walSegments.erase(_walSegments.begin(), _walSegments.begin() + _num_to_merge);
+            _walSegments.resize(_num_runs, 0);
+            _walSegments[_activeRun - _num_to_merge] = _wal->rotate();
         }
-        mergeThread = thread (&LSM::merge_runs, this, runs_to_merge,bf_to_merge); // comment for single threaded merging
-//        merge_runs(runs_to_merge, bf_to_merge); // uncomment for single threaded merging
         C_0.erase(C_0.begin(), C_0.begin() + _num_to_merge);
         filters.erase(filters.begin(), filters.begin() + _num_to_merge);
         
@@ -311,15 +892,443 @@ public:
         for (int i = _activeRun; i < _num_runs; i++){
             RunType * run = new RunType(INT32_MIN,INT32_MAX);
             run->set_size(_eltsPerRun);
-            C_0.push_back(run);
+            C_0.push_back(shared_ptr<Run<K,V>>(run));
+            
+            FilterType * bf = new FilterType(_eltsPerRun, _bfFalsePositiveRate);
+            filters.push_back(shared_ptr<FilterType>(bf));
+        }
+        enqueueFlush(runs_to_merge, bf_to_merge, lastSegment, batchBytes);
+    }
+    
+    // Keep filling the buffer while earlier batches flush, up to
+    // maxFlushBatches of them and bufferMemoryLimit bytes; when over, wait
+    // for batches to reach level 1 (not for the merges below).
+    void waitForFlushRoom(size_t bufferBytes){
+        auto room = [this, bufferBytes]{
+            return _flushQueue.empty() || (_flushQueue.size() < max(_options.maxFlushBatches, 1u) && (_options.bufferMemoryLimit == 0 || flushingBytes() + bufferBytes <= _options.bufferMemoryLimit));
+        };
+        unique_lock<mutex> l(*mergeLock);
+        if (!room()){
+            uint64_t started = Metrics::now();
+            _mergeDone->wait(l, room);
+            countStall(started);
+        }
+    }
+    
+    // The tuner picked another shape for the full buffer: queue all of it,
+    // in batches of the old shape, and start over with next's runs. Runs not
+    // queued yet stay in the buffer, so readers see every run throughout.
+    // Caller has exclusive access to the buffer.
+    void reshapeBuffer(const BufferShape &next){
+        unsigned oldRuns = _num_runs, oldToMerge = _num_to_merge;
+        vector<uint64_t> segments = _walSegments;
+        for (int i = 0; i < next.numRuns; i++){
+            RunType * run = new RunType(INT32_MIN,INT32_MAX);
+            run->set_size(next.eltsPerRun);
+            C_0.push_back(shared_ptr<Run<K,V>>(run));
+            
+            FilterType * bf = new FilterType(next.eltsPerRun, _bfFalsePositiveRate);
+            filters.push_back(shared_ptr<FilterType>(bf));
+        }
+        if (_wal){
+            _walSegments.assign(next.numRuns, 0);
+            _walSegments[0] = _wal->rotate();
+        }
+        for (unsigned i = 0; i < oldRuns; i += oldToMerge){
+            unsigned k = min(oldToMerge, oldRuns - i);
+            size_t bufferBytes = 0, batchBytes = 0;
+            for (int j = 0; j < C_0.size(); j++){
+                size_t bytes = runBytes(C_0[j], filters[j]);
+                bufferBytes += bytes;
+                batchBytes += j < k ? bytes : 0;
+            }
+            waitForFlushRoom(bufferBytes);
+            vector<shared_ptr<Run<K,V>>> runs_to_merge(C_0.begin(), C_0.begin() + k);
+            vector<shared_ptr<FilterType>> bf_to_merge(filters.begin(), filters.begin() + k);
+            C_0.erase(C_0.begin(), C_0.begin() + k);
+            filters.erase(filters.begin(), filters.begin() + k);
+            enqueueFlush(runs_to_merge, bf_to_merge, _wal ? segments[i + k - 1] : 0, batchBytes);
+        }
+        {
+            lock_guard<mutex> l(*mergeLock); // the manifest records the buffer's shape
+            _num_runs = next.numRuns;
+            _eltsPerRun = next.eltsPerRun;
+            _frac_runs_merged = next.mergedFrac;
+            _num_to_merge = next.numToMerge();
+        }
+        _activeRun = 0;
+    }
+    // write the whole buffer to disk, _num_to_merge runs at a time; the
+    // persistent tree does this on shutdown so a reopen finds everything
+    void flush_buffer(){
+        waitForMerges();
+        if (_num_to_merge == 0){
+            return;
+        }
+        unsigned int filled = min(_activeRun + 1, _num_runs);
+        if (C_0[filled - 1]->num_elements() == 0){
+            --filled; // the active run may still be empty
+        }
+        for (unsigned int i = 0; i < filled; i += _num_to_merge){
+            unsigned int end = min(i + _num_to_merge, filled);
+            vector<shared_ptr<Run<K,V>>> runs_to_merge(C_0.begin() + i, C_0.begin() + end);
+            vector<shared_ptr<FilterType>> bf_to_merge(filters.begin() + i, filters.begin() + end);
+            enqueueFlush(runs_to_merge, bf_to_merge, _wal ? _walSegments[end - 1] : 0, 0);
+            waitForMerges();
+        }
+        C_0.erase(C_0.begin(), C_0.begin() + filled);
+        filters.erase(filters.begin(), filters.begin() + filled);
+        _activeRun = 0;
+    }
+    
+    // multi_get for at most MULTI_GET_BATCH keys; pending holds the keys not
+    // yet found in a newer run, which are the only ones an older run is asked
+    // about
+    void multiGetBatch(const K *keys, size_t n, V *out, bool *found, Metrics::Shard *metrics){
+        array<uint64_t, 2> hashes[MULTI_GET_BATCH];
+        unsigned pending[MULTI_GET_BATCH];
+        unsigned numPending = 0;
+        for (unsigned i = 0; i < n; i++){
+            hashes[i] = FilterType::hash(&keys[i], sizeof(K));
+            found[i] = false;
+            pending[numPending++] = i;
+        }
+        
+        EpochGuard guard;
+        const ReadView *view = _view->load(memory_order_acquire);
+        const vector<shared_ptr<Run<K,V>>> *memRuns[] = {&view->buffer, &view->flushing};
+        const vector<shared_ptr<FilterType>> *memFilters[] = {&view->bufferFilters, &view->flushingFilters};
+        for (int m = 0; m < 2; m++){
+            for (int r = (int) memRuns[m]->size() - 1; r >= 0 && numPending > 0; --r){
+                Run<K,V> &run = *(*memRuns[m])[r];
+                FilterType &bf = *(*memFilters[m])[r];
+                K minKey = run.get_min(), maxKey = run.get_max();
+                for (unsigned p = 0; p < numPending; p++){
+                    bf.prefetch(hashes[pending[p]]);
+                }
+                unsigned left = 0;
+                for (unsigned p = 0; p < numPending; p++){
+                    unsigned i = pending[p];
+                    if (keys[i] >= minKey && keys[i] <= maxKey && bf.mayContain(hashes[i])){
+                        out[i] = run.lookup(keys[i], found[i]);
+                    }
+                    if (!found[i]){
+                        pending[left++] = i;
+                    }
+                }
+                numPending = left;
+            }
+        }
+        
+        unsigned long starts[MULTI_GET_BATCH], ends[MULTI_GET_BATCH];
+        unsigned probed[MULTI_GET_BATCH];
+        for (int l = 0; l < view->levels.size() && numPending > 0; l++){
+            for (int r = (int) view->levels[l].size() - 1; r >= 0 && numPending > 0; --r){
+                DiskRun<K,V,FilterType> &run = *view->levels[l][r];
+                if (run.maxKey == INT_MIN){
+                    continue;
+                }
+                unsigned inRange = 0;
+                for (unsigned p = 0; p < numPending; p++){
+                    unsigned i = pending[p];
+                    if (keys[i] >= run.minKey && keys[i] <= run.maxKey){
+                        run.bf.prefetch(hashes[i]);
+                        probed[inRange++] = i;
+                    }
+                }
+                unsigned numProbed = 0;
+                for (unsigned p = 0; p < inRange; p++){
+                    unsigned i = probed[p];
+                    if (run.bf.mayContain(hashes[i])){
+                        run.locate(keys[i], starts[i], ends[i]);
+                        probed[numProbed++] = i;
+                    }
+                    else if (metrics){
+                        metrics->addLevel(Metrics::FILTER_NEGATIVES, l);
+                    }
+                }
+                for (unsigned p = 0; p < numProbed; p++){
+                    unsigned i = probed[p];
+                    out[i] = run.lookupIn(starts[i], ends[i], keys[i], found[i]);
+                    if (metrics){
+                        metrics->add(Metrics::FENCE_SEARCHES);
+                        metrics->addLevel(found[i] ? Metrics::FILTER_TRUE_POSITIVES : Metrics::FILTER_FALSE_POSITIVES, l);
+                    }
+                }
+                if (numProbed > 0){
+                    unsigned left = 0;
+                    for (unsigned p = 0; p < numPending; p++){
+                        if (!found[pending[p]]){
+                            pending[left++] = pending[p];
+                        }
+                    }
+                    numPending = left;
+                }
+            }
+        }
+        
+        for (unsigned i = 0; i < n; i++){
+            found[i] = found[i] && out[i] != V_TOMBSTONE;
+        }
+    }
+    
+#ifdef LSM_COROUTINES
+    // find, as a coroutine over a view the caller keeps alive; found only
+    // if the key is live
+    LookupTask<LookupResult<V>> findTask(const ReadView *view, const K key, Metrics::Shard *metrics){
+        auto keyHash = FilterType::hash(&key, sizeof(K));
+        // the buffer's filters are small and hot, so only its skiplists yield
+        const vector<shared_ptr<Run<K,V>>> *memRuns[] = {&view->buffer, &view->flushing};
+        const vector<shared_ptr<FilterType>> *memFilters[] = {&view->bufferFilters, &view->flushingFilters};
+        for (int m = 0; m < 2; m++){
+            for (int r = (int) memRuns[m]->size() - 1; r >= 0; --r){
+                RunType *run = static_cast<RunType *>((*memRuns[m])[r].get());
+                if (key < run->get_min() || key > run->get_max() || !(*memFilters[m])[r]->mayContain(keyHash)){
+                    continue;
+                }
+                LookupResult<V> res = co_await run->lookupTask(key);
+                if (res.found){
+                    co_return LookupResult<V>{res.value != V_TOMBSTONE, res.value};
+                }
+            }
+        }
+        for (int l = 0; l < view->levels.size(); l++){
+            for (int r = (int) view->levels[l].size() - 1; r >= 0; --r){
+                DiskRun<K,V,FilterType> *run = view->levels[l][r].get();
+                if (run->maxKey == INT_MIN || key < run->minKey || key > run->maxKey){
+                    continue;
+                }
+                run->bf.prefetch(keyHash);
+                co_await suspend_always();
+                if (!run->bf.mayContain(keyHash)){
+                    if (metrics){
+                        metrics->addLevel(Metrics::FILTER_NEGATIVES, l);
+                    }
+                    continue;
+                }
+                LookupResult<V> res = co_await run->lookupTask(key);
+                if (metrics){
+                    metrics->add(Metrics::FENCE_SEARCHES);
+                    metrics->addLevel(res.found ? Metrics::FILTER_TRUE_POSITIVES : Metrics::FILTER_FALSE_POSITIVES, l);
+                }
+                if (res.found){
+                    co_return LookupResult<V>{res.value != V_TOMBSTONE, res.value};
+                }
+            }
+        }
+        co_return LookupResult<V>{false, (V) NULL};
+    }
+#endif
+    
+    // newest run first; true if the key is there, tombstone or not
+    static bool lookupMemory(const vector<shared_ptr<Run<K,V>>> &runs, const vector<shared_ptr<FilterType>> &bfs, const K &key, const array<uint64_t, 2> &keyHash, V &value){
+        for (int i = (int) runs.size() - 1; i >= 0; --i){
+            if (key < runs[i]->get_min() || key > runs[i]->get_max() || !bfs[i]->mayContain(keyHash))
+                continue;
             
-            BloomFilter<K> * bf = new BloomFilter<K>(_eltsPerRun, _bfFalsePositiveRate);
-            filters.push_back(bf);
+            bool found = false;
+            value = runs[i]->lookup(key, found);
+            if (found) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // swap in next and retire the view it replaces; caller holds viewLock
+    void swapView(ReadView *next){
+        ReadView *old = _view->exchange(next, memory_order_acq_rel);
+        EpochManager::instance().retire(old, [](void *p){ delete (ReadView *) p; });
+    }
+    
+    // the buffer was just rotated by the writer: C_0 is new and the rotated
+    // runs were queued to flush; caller holds mergeLock and owns the buffer
+    void publishBuffer(){
+        lock_guard<mutex> l(*viewLock);
+        ReadView *next = new ReadView(*_view->load());
+        next->buffer = C_0;
+        next->bufferFilters = filters;
+        setFlushing(next);
+        swapView(next);
+    }
+    
+    // a merge committed: the disk levels and the flush queue are as it left
+    // them; the caller holds mergeLock, so neither changes underneath
+    void publishLevels(){
+        lock_guard<mutex> l(*viewLock);
+        ReadView *next = new ReadView(*_view->load());
+        setFlushing(next);
+        next->levels.clear();
+        for (int i = 0; i < _numDiskLevels; ++i){
+            next->levels.push_back(diskLevels[i]->liveRuns());
         }
+        swapView(next);
     }
+    
+    void setFlushing(ReadView *view){
+        view->flushing.clear();
+        view->flushingFilters.clear();
+        for (int i = 0; i < _flushQueue.size(); ++i){
+            view->flushing.insert(view->flushing.end(), _flushQueue[i].runs.begin(), _flushQueue[i].runs.end());
+            view->flushingFilters.insert(view->flushingFilters.end(), _flushQueue[i].filters.begin(), _flushQueue[i].filters.end());
+        }
+    }
+    
+    void openFromManifest(const Manifest<K> &manifest){
+        _eltsPerRun = manifest.eltsPerRun;
+        _num_runs = manifest.numRuns;
+        _frac_runs_merged = manifest.mergedFrac;
+        _bfFalsePositiveRate = manifest.bf_fp;
+        _pageSize = manifest.pageSize;
+        _diskRunsPerLevel = manifest.diskRunsPerLevel;
+        _num_to_merge = ceil(_frac_runs_merged * _num_runs);
+        for (size_t l = 0; l < manifest.levels.size(); ++l){
+            const typename Manifest<K>::LevelEntry &le = manifest.levels[l];
+            vector<pair<unsigned, unsigned long>> liveRuns;
+            for (size_t r = 0; r < le.runs.size(); ++r){
+                liveRuns.push_back(make_pair(le.runs[r].runID, le.runs[r].capacity));
+            }
+            diskLevels.push_back(new DiskLevel<K,V,FilterType>(_pageSize, le.level, le.runSize, le.numRuns, le.mergeSize, le.bf_fp, _options.dataDir, liveRuns, le.nextRunID, (MergePolicy) le.policy, le.sizeRatio, _blockCache));
+        }
+        _numDiskLevels = (unsigned int) diskLevels.size();
+    }
+    
+    // Monkey allocation of filterMemoryBudget. A lookup probes a run for
+    // nothing with the run's false positive rate, so the expected waste is
+    // the sum of the rates over all runs, and for a fixed number of bits that
+    // sum is smallest when each run's rate is proportional to its length. The
+    // deep, large levels get higher rates and the small shallow ones much
+    // lower. A level is counted at the runs it holds plus the one it will get
+    // next rather than at capacity, since levels spend most of their time far
+    // from full, so this is redone after every merge (which is also what
+    // creates a level). Runs pick up their level's rate as they are sealed.
+    // Caller holds mergeLock or is the only thread touching the disk levels.
+    void allocateFilterMemory(){
+        if (_options.filterMemoryBudget == 0){
+            return;
+        }
+        vector<unsigned long> runSize;
+        vector<unsigned> numRuns;
+        for (int i = 0; i < _numDiskLevels; ++i){
+            runSize.push_back(diskLevels[i]->_runSize);
+            numRuns.push_back(min(diskLevels[i]->_activeRun + 1, diskLevels[i]->_numRuns));
+        }
+        vector<double> rates = monkeyRates(runSize, numRuns, _options.filterMemoryBudget * 8.0);
+        for (int i = 0; i < _numDiskLevels; ++i){
+            diskLevels[i]->_bf_fp = rates[i];
+        }
+    }
+    
+    // rate_i = c * runSize_i, with c set so that sum over levels of
+    // numRuns_i * runSize_i * ln(1 / rate_i) / ln(2)^2 = bits. A level whose
+    // rate comes out at MAX_RATE or more is capped there, its filters' cost is
+    // taken out of the bits, and the others are solved again with what is
+    // left. The cap is 0.5 because a filter needs at least a bit or so per key
+    // to be a filter at all; only a budget too small to give every level that
+    // much ends up over it.
+    static vector<double> monkeyRates(const vector<unsigned long> &runSize, const vector<unsigned> &numRuns, double bits){
+        const double MAX_RATE = 0.5;
+        double ln2sq = 0.480453013918201; // (ln(2))^2
+        vector<double> rates(runSize.size(), MAX_RATE);
+        vector<bool> capped(runSize.size(), false);
+        double cappedBits = 0;
+        while (true){
+            double entries = 0, weighted = 0;
+            for (size_t i = 0; i < runSize.size(); ++i){
+                if (!capped[i]){
+                    double n = (double) numRuns[i] * runSize[i];
+                    entries += n;
+                    weighted += n * log((double) runSize[i]);
+                }
+            }
+            if (entries == 0){
+                return rates;
+            }
+            double logC = (-(bits - cappedBits) * ln2sq - weighted) / entries;
+            bool changed = false;
+            for (size_t i = 0; i < runSize.size(); ++i){
+                if (capped[i]){
+                    continue;
+                }
+                rates[i] = exp(logC) * runSize[i];
+                if (rates[i] >= MAX_RATE){
+                    capped[i] = true;
+                    rates[i] = MAX_RATE;
+                    cappedBits += (double) numRuns[i] * runSize[i] * log(1 / MAX_RATE) / ln2sq;
+                    changed = true;
+                }
+            }
+            if (!changed){
+                return rates;
+            }
+        }
+    }
+    
+    // caller holds mergeLock or is the only thread touching the disk levels
+    void saveManifest(){
+        Manifest<K> manifest;
+        manifest.eltsPerRun = _eltsPerRun;
+        manifest.numRuns = _num_runs;
+        manifest.mergedFrac = _frac_runs_merged;
+        manifest.bf_fp = _bfFalsePositiveRate;
+        manifest.pageSize = _pageSize;
+        manifest.diskRunsPerLevel = _diskRunsPerLevel;
+        for (int i = 0; i < _numDiskLevels; ++i){
+            DiskLevel<K,V,FilterType> *level = diskLevels[i];
+            typename Manifest<K>::LevelEntry le;
+            le.level = level->_level;
+            le.runSize = level->_runSize;
+            le.numRuns = level->_numRuns;
+            le.mergeSize = level->_mergeSize;
+            le.bf_fp = level->_bf_fp;
+            le.nextRunID = level->_nextRunID;
+            le.policy = level->_policy;
+            le.sizeRatio = level->_sizeRatio;
+            for (int r = 0; r < level->_activeRun; ++r){
+                typename Manifest<K>::RunEntry re;
+                re.runID = level->runs[r]->getRunID();
+                re.capacity = level->runs[r]->getCapacity();
+                re.pageSize = level->runs[r]->pageSize;
+                re.minKey = level->runs[r]->minKey;
+                re.maxKey = level->runs[r]->maxKey;
+                le.runs.push_back(re);
+            }
+            manifest.levels.push_back(le);
+        }
+        manifest.save(_options.dataDir);
+    }
+    
+    // delete run files that belong to no run of the tree: inputs of finished
+    // merges, and whatever a crash left behind before the manifest caught up
+    void purgeObsoleteFiles(){
+        set<string> live;
+        for (int i = 0; i < _numDiskLevels; ++i){
+            for (int r = 0; r < diskLevels[i]->runs.size(); ++r){
+                live.insert(DiskRun<K,V,FilterType>::fileName("", diskLevels[i]->_level, diskLevels[i]->runs[r]->getRunID()));
+                live.insert(DiskRun<K,V,FilterType>::fileName("", diskLevels[i]->_level, diskLevels[i]->runs[r]->getRunID(), "idx"));
+            }
+        }
+        DIR *d = opendir(_options.dataDir.c_str());
+        if (d == NULL){
+            return;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL){
+            int level;
+            unsigned runID;
+            char ext[8];
+            if (sscanf(entry->d_name, "C_%d_%u.%7s", &level, &runID, ext) == 3 && (strcmp(ext, "txt") == 0 || strcmp(ext, "idx") == 0) && live.count(entry->d_name) == 0){
+                string name = _options.dataDir + "/" + entry->d_name;
+                if (unlink(name.c_str()) == -1 && errno != ENOENT){
+                    perror(("Error removing obsolete run " + name).c_str());
+                }
+            }
+        }
+        closedir(d);
+    }
+    
     unsigned long num_buffer(){
-        if (mergeThread.joinable())
-            mergeThread.join();
+        waitForMerges();
         unsigned long total = 0;
         for (int i = 0; i <= _activeRun; ++i)
             total += C_0[i]->num_elements();
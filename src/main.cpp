@@ -28,6 +28,10 @@
 #include <math.h>
 #include <random>
 #include <algorithm>
+#include <map>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
 #include "skipList.hpp"
 #include "bloom.hpp"
 #include "hashMap.hpp"
@@ -92,6 +96,238 @@ void bloomFilterTest(){
     
     
 }
+template <class FilterType>
+void bloomFilterTrial(const char *name, const vector<int> &keys, const vector<int> &absent, double fprate){
+    FilterType bf(keys.size(), fprate);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < keys.size(); i++) {
+        bf.add(&keys[i], sizeof(int));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double total_add = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    
+    int fp = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < absent.size(); i++) {
+        fp += bf.mayContain(&absent[i], sizeof(int));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double total_probe = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    
+    cout << name << " " << fprate << " " << ((double) fp / absent.size()) << " " << (int) (keys.size() / total_add) << " " << (int) (absent.size() / total_probe) << endl;
+}
+
+void bloomFilterCompareTest(){
+    std::mt19937                        generator(42);
+    std::uniform_int_distribution<int>  distribution(0, INT32_MAX);
+    
+    // big enough that the filter does not fit in cache, so probes pay for their misses
+    const int num_keys = 10000000;
+    vector<int> keys, absent;
+    for (int i = 0; i < num_keys; i++) {
+        keys.push_back(distribution(generator));
+        absent.push_back(-1 - distribution(generator)); // disjoint from keys
+    }
+    
+    cout << "filter target_fpr measured_fpr adds/sec negative_probes/sec" << endl;
+    vector<double> rates = {.1, .01, .001, .0001};
+    for (int r = 0; r < rates.size(); r++){
+        bloomFilterTrial<BloomFilter<int>>("standard", keys, absent, rates[r]);
+        bloomFilterTrial<BlockedBloomFilter<int>>("blocked", keys, absent, rates[r]);
+    }
+}
+
+// disk-run filter false positives per zero-result lookup, and lookups/sec
+template <class LSMType>
+void monkeyTrial(const char *name, LSMType &lsm, const vector<int> &absent){
+    long wasted = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < lsm.diskLevels.size(); i++){
+        for (int r = 0; r < lsm.diskLevels[i]->_activeRun; r++){
+            auto &bf = lsm.diskLevels[i]->runs[r]->bf;
+            bytes += bf.dataBytes();
+            for (int j = 0; j < absent.size(); j++){
+                wasted += bf.mayContain(&absent[j], sizeof(int));
+            }
+        }
+    }
+    int lookup;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int j = 0; j < absent.size(); j++){
+        int key = absent[j];
+        lsm.lookup(key, lookup);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double total = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    cout << name << " " << bytes << " " << (double) wasted / absent.size() << " " << (int) (absent.size() / total) << endl;
+}
+
+void monkeyFilterTest(){
+    std::mt19937                        generator(42);
+    std::uniform_int_distribution<int>  distribution(0, INT32_MAX);
+    
+    const int num_inserts = 5000000;
+    const int num_runs = 20;
+    const int buffer_capacity = 800;
+    const double bf_fp = .01;
+    const int pageSize = 512;
+    const int disk_runs_per_level = 10;
+    const double merge_fraction = 1;
+    
+    vector<int> absent;
+    for (int i = 0; i < 1000000; i++){
+        absent.push_back(-1 - distribution(generator));
+    }
+    
+    // Monkey gets the memory a uniform 1% would take at num_inserts keys, and
+    // the uniform tree is then given a rate that spends what Monkey actually
+    // spent. Runs of a non-persistent tree live in the working directory, so
+    // the two trees are built one after the other.
+    LSMOptions options;
+    options.filterMemoryBudget = (size_t) (num_inserts * -log(bf_fp) / 0.480453013918201 / 8);
+    size_t spent = 0;
+    unsigned long entries = 0;
+    cout << "allocation filter_bytes wasted_probes/lookup zero_result_lookups/sec" << endl;
+    for (int trial = 0; trial < 2; trial++){
+        double fp = trial == 0 ? bf_fp : exp(-(spent * 8.0 / entries) * 0.480453013918201);
+        LSM<int, int> lsm(buffer_capacity, num_runs, merge_fraction, fp, pageSize, disk_runs_per_level, trial == 0 ? options : LSMOptions());
+        generator.seed(7);
+        for (int i = 0; i < num_inserts; i++){
+            int key = distribution(generator);
+            lsm.insert_key(key, i);
+        }
+        lsm.waitForMerges();
+        if (trial == 0){
+            for (int i = 0; i < lsm.diskLevels.size(); i++){
+                for (int r = 0; r < lsm.diskLevels[i]->_activeRun; r++){
+                    spent += lsm.diskLevels[i]->runs[r]->bf.dataBytes();
+                    entries += lsm.diskLevels[i]->runs[r]->getCapacity();
+                }
+            }
+        }
+        monkeyTrial(trial == 0 ? "monkey" : "uniform", lsm, absent);
+    }
+}
+
+// Inserts/sec, lookups/sec and disk runs a lookup may probe under each merge
+// policy. Leveling should trade insert speed for fewer runs and faster lookups,
+// with lazy leveling in between.
+void mergePolicyTest(){
+    std::mt19937                        generator(42);
+    std::uniform_int_distribution<int>  distribution(0, 4000000);
+    
+    const int num_inserts = 4000000;
+    const int num_lookups = 1000000;
+    const MergePolicy policies[] = {TIERING, LEVELING, LAZY_LEVELING};
+    const char *names[] = {"tiering", "leveling", "lazy_leveling"};
+    
+    cout << "policy inserts/sec lookups/sec disk_runs" << endl;
+    for (int p = 0; p < 3; p++){
+        LSMOptions options;
+        options.mergePolicy = policies[p];
+        LSM<int, int> lsm(800, 20, 1.0, .001, 512, 10, options);
+        generator.seed(7);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_inserts; i++){
+            int key = distribution(generator);
+            lsm.insert_key(key, i);
+        }
+        lsm.waitForMerges();
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double insertTime = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        
+        int lookup;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_lookups; i++){
+            int key = distribution(generator);
+            lsm.lookup(key, lookup);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double lookupTime = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        
+        unsigned runs = 0;
+        for (int i = 0; i < lsm.diskLevels.size(); i++){
+            runs += lsm.diskLevels[i]->_activeRun;
+        }
+        cout << names[p] << " " << (int) (num_inserts / insertTime) << " " << (int) (num_lookups / lookupTime) << " " << runs << endl;
+    }
+}
+
+// Shifting workload: write-only, then read-mostly, then scan-heavy, then
+// write-only again. For a fixed tree and an auto-tuned one, prints each
+// phase's ops/sec and the buffer shape the phase ended with; the tuned tree
+// should settle on one shape per phase and keep it.
+void autoTuneTest(){
+    std::mt19937                        generator(42);
+    std::uniform_int_distribution<int>  distribution(0, 2000000);
+    
+    const int ops_per_phase = 2000000;
+    const int read_pct[] = {0, 95, 80, 0};
+    const int range_pct[] = {0, 0, 15, 0};
+    const char *phases[] = {"write", "read", "scan", "write"};
+    
+    cout << "tree phase ops/sec buffer_runs elts_per_run runs_merged" << endl;
+    for (int tuned = 0; tuned < 2; tuned++){
+        LSMOptions options;
+        options.autoTuneInterval = tuned ? 200000 : 0;
+        LSM<int, int> lsm(800, 20, 1.0, .001, 512, 20, options);
+        generator.seed(7);
+        for (int p = 0; p < 4; p++){
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < ops_per_phase; i++){
+                int key = distribution(generator);
+                int op = generator() % 100;
+                if (op < read_pct[p]){
+                    int lookup;
+                    lsm.lookup(key, lookup);
+                }
+                else if (op < read_pct[p] + range_pct[p]){
+                    int end = key + 100;
+                    lsm.range(key, end);
+                }
+                else {
+                    lsm.insert_key(key, i);
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &finish);
+            double total = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+            cout << (tuned ? "tuned " : "fixed ") << phases[p] << " " << (int) (ops_per_phase / total) << " " << lsm._num_runs << " " << lsm._eltsPerRun << " " << lsm._num_to_merge << endl;
+        }
+    }
+}
+
+// Mixed inserts, deletes, lookups and ranges, then the tree's metrics as JSON.
+void metricsTest(){
+    std::mt19937                        generator(42);
+    std::uniform_int_distribution<int>  distribution(0, 4000000);
+    
+    const int num_ops = 2000000;
+    LSMOptions options;
+    options.metrics = true;
+    LSM<int, int> lsm(800, 20, 1.0, .001, 512, 10, options);
+    for (int i = 0; i < num_ops; i++){
+        int key = distribution(generator);
+        int op = generator() % 100;
+        if (op < 50){
+            lsm.insert_key(key, i);
+        }
+        else if (op < 55){
+            lsm.delete_key(key);
+        }
+        else if (op < 99){
+            int lookup;
+            lsm.lookup(key, lookup);
+        }
+        else {
+            int end = key + 1000;
+            lsm.range(key, end);
+        }
+    }
+    lsm.waitForMerges();
+    cout << lsm.metrics()->toJSON() << endl;
+}
+
 void insertLookupTest(){
     std::random_device                  rand_dev;
     std::mt19937                        generator(rand_dev());
@@ -344,6 +580,104 @@ void fencePointerTest(){
 //    
 }
 
+// Build a tree with inserts, updates and deletes, then stop it: either a clean
+// close or a crash (a forked child that _exits without flushing or merging
+// down). Reopen it in the same directories and compare every key and a full
+// range scan with what was written. With a data directory the reopened
+// levels come from the MANIFEST and each run's .idx file; with only a log
+// the whole tree comes back from replaying it.
+void recoveryRun(const string &name, const string &dataDir, const string &walDir, bool crash){
+    system(("rm -rf " + dataDir + " " + walDir).c_str());
+    LSMOptions options;
+    options.dataDir = dataDir;
+    options.walDir = walDir;
+    options.walSync = WAL_SYNC_BATCH; // every insert is durable when it returns, so a crash loses none
+    const int num_ops = 200000;
+    const int key_space = 50000;
+    
+    map<int, int> expected;
+    std::mt19937 generator(9);
+    vector<pair<int, int>> ops; // value -1 deletes
+    for (int i = 0; i < num_ops; i++){
+        int key = (int) (generator() % key_space);
+        int value = generator() % 10 == 0 ? -1 : i;
+        ops.push_back(make_pair(key, value));
+        if (value == -1){
+            expected.erase(key);
+        }
+        else {
+            expected[key] = value;
+        }
+    }
+    
+    pid_t pid = crash ? fork() : 0;
+    if (pid == 0){
+        LSM<int, int> lsm(800, 20, 0.5, .001, 512, 4, options);
+        for (int i = 0; i < num_ops; i++){
+            if (ops[i].second == -1){
+                lsm.delete_key(ops[i].first);
+            }
+            else {
+                lsm.insert_key(ops[i].first, ops[i].second);
+            }
+        }
+        if (crash){
+            _exit(0);
+        }
+    }
+    else {
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    
+    int sidecars = 0;
+    DIR *dir = dataDir.empty() ? NULL : opendir(dataDir.c_str());
+    if (dir != NULL){
+        for (struct dirent *e = readdir(dir); e != NULL; e = readdir(dir)){
+            string file = e->d_name;
+            sidecars += file.size() > 4 && file.compare(file.size() - 4, 4, ".idx") == 0;
+        }
+        closedir(dir);
+    }
+    
+    int missing = 0, wrong = 0, resurrected = 0;
+    bool scanMatches;
+    {   // the reopened tree must be gone before its directories are
+        LSM<int, int> lsm(800, 20, 0.5, .001, 512, 4, options);
+        for (int key = 0; key < key_space; key++){
+            int value;
+            bool found = lsm.lookup(key, value);
+            auto it = expected.find(key);
+            if (it == expected.end()){
+                resurrected += found;
+            }
+            else if (!found){
+                missing++;
+            }
+            else if (value != it->second){
+                wrong++;
+            }
+        }
+        int lo = 0, hi = key_space;
+        vector<KVPair<int, int>> scan = lsm.range(lo, hi);
+        scanMatches = scan.size() == expected.size();
+        auto it = expected.begin();
+        for (size_t i = 0; scanMatches && i < scan.size(); i++, it++){
+            scanMatches = scan[i].key == it->first && scan[i].value == it->second;
+        }
+    }
+    cout << name << (crash ? " crash" : " close") << ": " << expected.size() << " keys, missing " << missing << " wrong " << wrong << " resurrected " << resurrected
+    << " range " << (scanMatches ? "ok" : "MISMATCH") << " index files " << sidecars << endl;
+    system(("rm -rf " + dataDir + " " + walDir).c_str());
+}
+
+void recoveryTest(){
+    recoveryRun("data", "recovery_data", "", false);
+    recoveryRun("data+wal", "recovery_data", "recovery_wal", false);
+    recoveryRun("data+wal", "recovery_data", "recovery_wal", true);
+    recoveryRun("wal only", "", "recovery_wal", true);
+}
+
 void updateDeleteTest(){
     const int num_inserts = 500;
     const int num_runs = 3;
@@ -597,6 +931,151 @@ void concurrentLookupTest(){
     }
 }
 
+void concurrentInsertTest(){
+    std::random_device                  rand_dev;
+    std::mt19937                        generator(rand_dev());
+    std::uniform_int_distribution<int>  distribution(INT32_MIN, INT32_MAX);
+    
+    const int num_inserts = 4000000;
+    const int num_runs = 20;
+    const int buffer_capacity = 8000;
+    const double bf_fp = .001;
+    const int pageSize = 512;
+    const int disk_runs_per_level = 20;
+    const double merge_fraction = 1;
+    
+    std::vector<int> to_insert;
+    for (int i = 0; i < num_inserts; i++) {
+        to_insert.push_back(distribution(generator));
+    }
+    
+    cout << "nthreads time inserts/sec" << endl;
+    for (int nthreads = 1; nthreads <= 16; nthreads *= 2){
+        LSM<int32_t, int32_t, ConcurrentSkipList<int32_t, int32_t>> lsmTree(buffer_capacity, num_runs, merge_fraction, bf_fp, pageSize, disk_runs_per_level);
+        auto threads = vector<thread>(nthreads);
+        
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int t = 0; t < nthreads; t++){
+            threads[t] = thread ([&, t] {
+                for (int i = t; i < num_inserts; i += nthreads) {
+                    lsmTree.insert_key(to_insert[i], i);
+                }
+            });
+        }
+        for (int t = 0; t < nthreads; t++)
+            threads[t].join();
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        
+        double total_insert = (finish.tv_sec - start.tv_sec);
+        total_insert += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        cout << nthreads << " " << total_insert << " " << (int) (num_inserts / total_insert) << endl;
+    }
+}
+
+// Flushes into level 1 alongside merges that deepen the tree: two runs per
+// level add a level every few flushes, and 4000-pair flushes take long
+// enough for a deep merge to commit meanwhile. Every
+// key must be there afterwards. Worth running under -fsanitize=thread.
+void flushMergeRaceTest(){
+    const int nthreads = 4;
+    const int keys_per_thread = 50000;
+    
+    for (int round = 0; round < 8; round++){
+        LSMOptions options;
+        options.compactionThreads = 4;
+        options.maxFlushBatches = 4;
+        LSM<int32_t, int32_t, ConcurrentSkipList<int32_t, int32_t>> lsmTree(1000, 4, 1, .01, 64, 2, options);
+        auto threads = vector<thread>(nthreads);
+        for (int t = 0; t < nthreads; t++){
+            threads[t] = thread ([&, t] {
+                for (int i = 0; i < keys_per_thread; i++) {
+                    int key = i * nthreads + t;
+                    lsmTree.insert_key(key, key);
+                }
+            });
+        }
+        for (int t = 0; t < nthreads; t++)
+            threads[t].join();
+        lsmTree.waitForMerges();
+        
+        int missing = 0;
+        for (int key = 0; key < nthreads * keys_per_thread; key++){
+            int value;
+            if (!lsmTree.lookup(key, value) || value != key)
+                missing++;
+        }
+        cout << "round " << round << ": " << lsmTree._numDiskLevels << " levels, " << missing << " missing" << endl;
+    }
+}
+
+void mixedReadWriteTest(){
+    std::random_device                  rand_dev;
+    std::mt19937                        generator(rand_dev());
+    std::uniform_int_distribution<int>  distribution(INT32_MIN, INT32_MAX);
+
+    const int num_inserts = 4000000;
+    const int num_runs = 20;
+    const int buffer_capacity = 8000;
+    const double bf_fp = .001;
+    const int pageSize = 512;
+    const int disk_runs_per_level = 20;
+    const double merge_fraction = 1;
+
+    std::vector<int> to_insert;
+    for (int i = 0; i < num_inserts; i++) {
+        to_insert.push_back(distribution(generator));
+    }
+
+    // one writer inserts everything while the readers look up keys it has already written
+    cout << "nreaders time inserts/sec lookups/sec" << endl;
+    for (int nreaders = 1; nreaders <= 8; nreaders *= 2){
+        LSM<int32_t, int32_t, ConcurrentSkipList<int32_t, int32_t>> lsmTree(buffer_capacity, num_runs, merge_fraction, bf_fp, pageSize, disk_runs_per_level);
+        atomic<int> inserted(0);
+        atomic<bool> done(false);
+        atomic<long> lookups(0);
+        auto readers = vector<thread>(nreaders);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int t = 0; t < nreaders; t++){
+            readers[t] = thread ([&, t] {
+                unsigned m = 1737119 * (t + 1);
+                long count = 0;
+                int lookup;
+                while (!done.load(memory_order_relaxed)) {
+                    int n = inserted.load(memory_order_acquire);
+                    if (n == 0) continue;
+                    m = m * 1103515245 + 12345;
+                    lsmTree.lookup(to_insert[m % n], lookup);
+                    count++;
+                }
+                lookups += count;
+            });
+        }
+        for (int i = 0; i < num_inserts; i++) {
+            lsmTree.insert_key(to_insert[i], i);
+            inserted.store(i + 1, memory_order_release);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        done = true;
+        for (int t = 0; t < nreaders; t++)
+            readers[t].join();
+
+        double total = (finish.tv_sec - start.tv_sec);
+        total += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        cout << nreaders << " " << total << " " << (int) (num_inserts / total) << " " << (long) (lookups / total) << endl;
+    }
+}
+
+void printLatencies(vector<double> &times){
+    sort(times.begin(), times.end());
+    const double pcts[] = {50, 90, 99, 99.9, 99.99};
+    for (double p : pcts){
+        cout << "p" << p << " latency: " << times[(size_t) (p / 100 * (times.size() - 1))] << endl;
+    }
+    cout << "largest latency: " << times[times.size() - 1] << endl;
+    cout << "smallest latency: " << times[0] << endl;
+}
+
 void tailLatencyTest(){
     std::random_device                  rand_dev;
     std::mt19937                        generator(rand_dev());
@@ -610,7 +1089,6 @@ void tailLatencyTest(){
     const int pageSize = 512;
     const int disk_runs_per_level = 2;
     const double merge_fraction = 1;
-    LSM<int32_t, int32_t> lsmTree = LSM<int32_t, int32_t>(buffer_capacity, num_runs,merge_fraction, bf_fp, pageSize, disk_runs_per_level);
     
     std::vector<int> to_insert;
     for (int i = 0; i < num_inserts; i++) {
@@ -619,19 +1097,32 @@ void tailLatencyTest(){
     }
     shuffle(to_insert.begin(), to_insert.end(), generator);
     
-    auto times = vector<double>(num_inserts);
+    // once with no stall control, then slowing inserts down as merge debt
+    // builds up instead of letting them pile into one long pause
+    LSMOptions stalls;
+    stalls.slowdownMergeDebt = buffer_capacity * num_runs;
+    stalls.stopMergeDebt = 8 * buffer_capacity * num_runs;
+    stalls.slowdownWriteRate = 500000;
+    const LSMOptions configs[] = {LSMOptions(), stalls};
+    const char *names[] = {"no stall control", "stall control"};
     
-    //    std::cout << "Starting inserts" << std::endl;
-    
-    for (int i = 0; i < num_inserts; i++) {
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        lsmTree.insert_key(to_insert[i],i);
-        clock_gettime(CLOCK_MONOTONIC, &finish);
-        times.push_back((finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.);
+    for (int c = 0; c < 2; c++){
+        LSM<int32_t, int32_t> lsmTree = LSM<int32_t, int32_t>(buffer_capacity, num_runs,merge_fraction, bf_fp, pageSize, disk_runs_per_level, configs[c]);
+        
+        auto times = vector<double>();
+        times.reserve(num_inserts);
+        
+        //    std::cout << "Starting inserts" << std::endl;
+        
+        for (int i = 0; i < num_inserts; i++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            lsmTree.insert_key(to_insert[i],i);
+            clock_gettime(CLOCK_MONOTONIC, &finish);
+            times.push_back((finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.);
+        }
+        cout << names[c] << endl;
+        printLatencies(times);
     }
-    sort(times.begin(), times.end());
-    cout << "largest latency: " << times[times.size() - 1] << endl;
-    cout << "smallest latency: " << times[0] << endl;
 
 }
 
@@ -818,10 +1309,19 @@ void queryLine(LSM<int, int> &lsm, const string &line, vector<string> &strings){
 int main(int argc, char *argv[]){
 
 //    insertLookupTest();
+//    bloomFilterCompareTest();
+//    monkeyFilterTest();
+//    mergePolicyTest();
+//    autoTuneTest();
+//    metricsTest();
 //    updateDeleteTest();
+//    recoveryTest();
 //    rangeTest();
 //    rangeTimeTest();
 //    concurrentLookupTest();
+//    concurrentInsertTest();
+//    flushMergeRaceTest();
+//    mixedReadWriteTest();
 //    tailLatencyTest();
 //    cartesianTest();
 //    updateLookupSkewTest();
@@ -0,0 +1,183 @@
+//
+//  manifest.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef manifest_h
+#define manifest_h
+#include <stdio.h>
+#include <stdlib.h>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+using namespace std;
+
+// The manifest is the root of a persistent tree: a small text file naming
+// every live disk run with its level, size and key range, plus the tuning
+// parameters the tree was built with. It is rewritten (write to a temp file,
+// fsync, rename) after every merge, so at any moment the file on disk
+// describes a complete, consistent set of runs.
+template <class K>
+struct Manifest {
+    static const int VERSION = 2; // 2 added each level's merge policy
+
+    struct RunEntry {
+        unsigned runID;
+        unsigned long capacity; // number of KV pairs in the run
+        unsigned pageSize;
+        K minKey;
+        K maxKey;
+    };
+
+    struct LevelEntry {
+        int level;
+        unsigned long runSize;
+        unsigned numRuns;
+        unsigned mergeSize;
+        double bf_fp;
+        unsigned nextRunID;
+        int policy;            // a MergePolicy
+        unsigned sizeRatio;
+        vector<RunEntry> runs; // oldest first
+    };
+
+    unsigned long eltsPerRun;
+    unsigned numRuns;
+    double mergedFrac;
+    double bf_fp;
+    unsigned pageSize;
+    unsigned diskRunsPerLevel;
+    vector<LevelEntry> levels;
+
+    static string path(const string &dir) {
+        return dir + "/MANIFEST";
+    }
+
+    void save(const string &dir) {
+        ostringstream out;
+        out.precision(17);
+        out << "sLSM-manifest " << VERSION << "\n";
+        out << "params " << eltsPerRun << " " << numRuns << " " << mergedFrac << " " << bf_fp << " " << pageSize << " " << diskRunsPerLevel << "\n";
+        out << "levels " << levels.size() << "\n";
+        for (size_t l = 0; l < levels.size(); ++l) {
+            const LevelEntry &le = levels[l];
+            out << "level " << le.level << " " << le.runSize << " " << le.numRuns << " " << le.mergeSize << " " << le.bf_fp << " " << le.nextRunID << " " << le.policy << " " << le.sizeRatio << " " << le.runs.size() << "\n";
+            for (size_t r = 0; r < le.runs.size(); ++r) {
+                const RunEntry &re = le.runs[r];
+                out << "run " << re.runID << " " << re.capacity << " " << re.pageSize << " " << re.minKey << " " << re.maxKey << "\n";
+            }
+        }
+        out << "end\n";
+        writeAtomically(dir, path(dir), out.str());
+    }
+
+    // false if there is no manifest; a damaged one is fatal
+    bool load(const string &dir) {
+        ifstream in(path(dir).c_str());
+        if (!in.is_open()) {
+            return false;
+        }
+        string tag;
+        int version;
+        size_t numLevels;
+        in >> tag >> version;
+        if (tag != "sLSM-manifest" || version < 1 || version > VERSION) {
+            corrupt(dir);
+        }
+        in >> tag >> eltsPerRun >> numRuns >> mergedFrac >> bf_fp >> pageSize >> diskRunsPerLevel;
+        if (tag != "params") corrupt(dir);
+        in >> tag >> numLevels;
+        if (tag != "levels") corrupt(dir);
+        levels.clear();
+        for (size_t l = 0; l < numLevels; ++l) {
+            LevelEntry le;
+            size_t nRuns;
+            in >> tag >> le.level >> le.runSize >> le.numRuns >> le.mergeSize >> le.bf_fp >> le.nextRunID;
+            le.policy = 0; // version 1 trees are all tiered
+            le.sizeRatio = 0;
+            if (version >= 2) {
+                in >> le.policy >> le.sizeRatio;
+            }
+            in >> nRuns;
+            if (tag != "level") corrupt(dir);
+            for (size_t r = 0; r < nRuns; ++r) {
+                RunEntry re;
+                in >> tag >> re.runID >> re.capacity >> re.pageSize >> re.minKey >> re.maxKey;
+                if (tag != "run") corrupt(dir);
+                le.runs.push_back(re);
+            }
+            levels.push_back(le);
+        }
+        in >> tag;
+        if (tag != "end" || in.fail()) {
+            corrupt(dir);
+        }
+        return true;
+    }
+
+private:
+    static void corrupt(const string &dir) {
+        fprintf(stderr, "Manifest %s is damaged\n", path(dir).c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    static void writeAtomically(const string &dir, const string &target, const string &contents) {
+        string tmp = target + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, (mode_t) 0600);
+        if (fd == -1) {
+            perror(("Error opening " + tmp).c_str());
+            exit(EXIT_FAILURE);
+        }
+        size_t done = 0;
+        while (done < contents.size()) {
+            ssize_t w = write(fd, contents.data() + done, contents.size() - done);
+            if (w == -1) {
+                if (errno == EINTR) continue;
+                perror(("Error writing " + tmp).c_str());
+                exit(EXIT_FAILURE);
+            }
+            done += w;
+        }
+        if (fsync(fd) == -1) {
+            perror(("Error syncing " + tmp).c_str());
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        if (rename(tmp.c_str(), target.c_str())) {
+            perror(("Error renaming " + tmp + " to " + target).c_str());
+            exit(EXIT_FAILURE);
+        }
+        // make the rename itself durable
+        int dfd = open(dir.c_str(), O_RDONLY);
+        if (dfd != -1) {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+};
+
+#endif /* manifest_h */
@@ -0,0 +1,205 @@
+//
+//  mergeEngine.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef mergeEngine_h
+#define mergeEngine_h
+#include <vector>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include "run.hpp"
+#include "rateLimiter.hpp"
+
+using namespace std;
+
+// Reads a sorted array of pairs a block at a time, so the merge loop works
+// out of a small buffer that stays in cache instead of touching the mmapped
+// run directly.
+template <class K, class V>
+class BlockReader {
+public:
+    typedef KVPair<K,V> KVPair_t;
+    static const unsigned BLOCK = 512; // pairs per refill
+
+    BlockReader(const KVPair_t *src, unsigned long len): _src(src), _len(len), _next(0), _pos(0), _end(0) {
+        _buf.resize(BLOCK);
+        refill();
+    }
+
+    bool valid() const {
+        return _pos < _end;
+    }
+
+    const KVPair_t &head() const {
+        return _buf[_pos];
+    }
+
+    void next() {
+        if (++_pos == _end) {
+            refill();
+        }
+    }
+
+private:
+    const KVPair_t *_src;
+    unsigned long _len;
+    unsigned long _next; // first pair of _src not yet buffered
+    unsigned _pos;
+    unsigned _end;
+    vector<KVPair_t> _buf;
+
+    void refill() {
+        unsigned long n = min((unsigned long) BLOCK, _len - _next);
+        if (n > 0) {
+            memcpy(&_buf[0], _src + _next, n * sizeof(KVPair_t));
+        }
+        _next += n;
+        _pos = 0;
+        _end = (unsigned) n;
+    }
+};
+
+// Collects output pairs and copies them to the destination a block at a
+// time, so the destination is written strictly in order with large copies.
+// Each block is charged to the limiter, if there is one, before it is copied.
+template <class K, class V>
+class BulkWriter {
+public:
+    typedef KVPair<K,V> KVPair_t;
+    static const unsigned BLOCK = 512;
+
+    BulkWriter(KVPair_t *dst, unsigned long cap, RateLimiter *limiter = NULL): _dst(dst), _cap(cap), _written(0), _fill(0), _limiter(limiter) {
+        _buf.resize(BLOCK);
+    }
+
+    void append(const KVPair_t &kv) {
+        _buf[_fill++] = kv;
+        if (_fill == BLOCK) {
+            flush();
+        }
+    }
+
+    // pairs written so far, including any still buffered
+    unsigned long count() const {
+        return _written + _fill;
+    }
+
+    void flush() {
+        assert(_written + _fill <= _cap);
+        if (_limiter != NULL && _fill > 0) {
+            _limiter->request(_fill * sizeof(KVPair_t));
+        }
+        memcpy(_dst + _written, &_buf[0], _fill * sizeof(KVPair_t));
+        _written += _fill;
+        _fill = 0;
+    }
+
+private:
+    KVPair_t *_dst;
+    unsigned long _cap;
+    unsigned long _written;
+    unsigned _fill;
+    RateLimiter *_limiter;
+    vector<KVPair_t> _buf;
+};
+
+// Tournament (loser) tree over k sorted inputs. Internal node p holds the
+// input that lost the match played there and node 0 holds the overall winner,
+// so replacing the winner's head replays only the matches on its leaf-to-root
+// path: log2(k) comparisons per element, against a binary heap's ~2 log2(k)
+// for a pop followed by a push.
+//
+// Inputs are given oldest first. Equal keys come out newest first, which lets
+// merge() keep the first pair of each key and drop the rest.
+template <class K, class V>
+class LoserTree {
+public:
+    typedef KVPair<K,V> KVPair_t;
+
+    struct Input {
+        const KVPair_t *data;
+        unsigned long len;
+    };
+
+    LoserTree(const vector<Input> &inputs): _k((int) inputs.size()) {
+        assert(_k > 0);
+        _readers.reserve(_k);
+        for (int i = 0; i < _k; ++i) {
+            _readers.push_back(BlockReader<K,V>(inputs[i].data, inputs[i].len));
+        }
+        // -1 stands for a virtual input that beats everything, so playing
+        // every leaf in once leaves each node holding a real loser
+        _tree.assign(_k, -1);
+        for (int i = _k - 1; i >= 0; --i) {
+            replay(i);
+        }
+    }
+
+    // Merge everything into dst, keeping the newest pair of each key and
+    // dropping tombstones when dropTombstones is set. Returns the pair count.
+    unsigned long merge(KVPair_t *dst, unsigned long cap, const V &tombstone, bool dropTombstones, RateLimiter *limiter = NULL) {
+        BulkWriter<K,V> out(dst, cap, limiter);
+        bool any = false;
+        K lastKey = K();
+        while (_readers[_tree[0]].valid()) {
+            int w = _tree[0];
+            const KVPair_t &kv = _readers[w].head();
+            if (!any || kv.key != lastKey) {
+                any = true;
+                lastKey = kv.key;
+                if (!dropTombstones || kv.value != tombstone) {
+                    out.append(kv);
+                }
+            }
+            _readers[w].next();
+            replay(w);
+        }
+        out.flush();
+        return out.count();
+    }
+
+private:
+    int _k;
+    vector<BlockReader<K,V>> _readers;
+    vector<int> _tree;
+
+    // does input a come out before input b? exhausted inputs lose to everything
+    bool beats(int a, int b) const {
+        if (!_readers[b].valid()) return true;
+        if (!_readers[a].valid()) return false;
+        const K &ka = _readers[a].head().key, &kb = _readers[b].head().key;
+        return ka < kb || (ka == kb && a > b);
+    }
+
+    // leaf i sits at position k + i; play its new head up to the root
+    void replay(int i) {
+        int w = i;
+        for (int p = (i + _k) / 2; p > 0; p /= 2) {
+            if (_tree[p] == -1 || (w != -1 && beats(_tree[p], w))) {
+                swap(_tree[p], w);
+            }
+        }
+        _tree[0] = w;
+    }
+};
+
+#endif /* mergeEngine_h */
@@ -0,0 +1,436 @@
+//
+//  metrics.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef metrics_h
+#define metrics_h
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <unordered_set>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <chrono>
+
+using namespace std;
+
+// Log-linear latency histogram in the style of HdrHistogram: values below 16
+// get a bucket each, and every power of two above that is split into 16
+// buckets, so any recorded value is known to within 1/16 (about 6%) across
+// the whole range. Values are nanoseconds and top out around 36 minutes.
+class Histogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB = 1 << SUB_BITS;
+    static const int MAX_EXP = 41;
+    static const int BUCKETS = (MAX_EXP - SUB_BITS + 2) * SUB;
+
+    Histogram() {
+        clear();
+    }
+
+    void clear() {
+        _counts.assign(BUCKETS, 0);
+        _total = 0;
+        _sum = 0;
+        _max = 0;
+    }
+
+    void record(uint64_t v) {
+        add(bucket(v), 1, v);
+        setMax(v);
+    }
+
+    void add(int b, uint64_t n, uint64_t sum) {
+        _counts[b] += n;
+        _total += n;
+        _sum += sum;
+    }
+
+    void merge(const Histogram &other) {
+        for (int b = 0; b < BUCKETS; ++b) {
+            _counts[b] += other._counts[b];
+        }
+        _total += other._total;
+        _sum += other._sum;
+        _max = max(_max, other._max);
+    }
+
+    uint64_t count() const {
+        return _total;
+    }
+
+    double mean() const {
+        return _total == 0 ? 0 : (double) _sum / _total;
+    }
+
+    uint64_t maxValue() const {
+        return _max;
+    }
+
+    void setMax(uint64_t v) {
+        _max = max(_max, v);
+    }
+
+    // the value below which a fraction q of the recorded values fall
+    uint64_t percentile(double q) const {
+        if (_total == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t) (q * _total);
+        if (rank >= _total) {
+            rank = _total - 1;
+        }
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += _counts[b];
+            if (seen > rank) {
+                return min(bucketHigh(b), _max);
+            }
+        }
+        return _max;
+    }
+
+    static int bucket(uint64_t v) {
+        if (v < SUB) {
+            return (int) v;
+        }
+        int e = 63 - __builtin_clzll(v);
+        if (e > MAX_EXP) {
+            return BUCKETS - 1;
+        }
+        return (e - SUB_BITS + 1) * SUB + (int) ((v >> (e - SUB_BITS)) & (SUB - 1));
+    }
+
+    // largest value that lands in bucket b
+    static uint64_t bucketHigh(int b) {
+        if (b < SUB) {
+            return b;
+        }
+        int e = b / SUB + SUB_BITS - 1;
+        uint64_t low = (uint64_t) (SUB + b % SUB) << (e - SUB_BITS);
+        return low + ((uint64_t) 1 << (e - SUB_BITS)) - 1;
+    }
+
+private:
+    vector<uint64_t> _counts;
+    uint64_t _total;
+    uint64_t _sum;
+    uint64_t _max;
+};
+
+// What the tree counts about itself, at any moment, summed over threads.
+struct MetricsSnapshot;
+
+// Per-thread metrics registry. Every thread that touches the tree gets a
+// shard of its own the first time it records anything, and only that thread
+// writes to it, so recording is a plain load and store with no lock prefix and
+// no cache line shared with another thread. snapshot() sums the shards; a
+// count in flight on another thread may or may not make it in. Shards are
+// kept until the registry goes, so the counts of exited threads stay.
+//
+// Counters are exact. Operation latencies are timed for one operation in
+// SAMPLE per thread (see Shard::sample), which keeps the clock reads off most
+// operations; the histograms' counts are of sampled operations.
+class Metrics {
+public:
+    enum Counter {
+        INSERTS,
+        LOOKUPS,
+        LOOKUP_HITS,
+        RANGES,
+        FENCE_SEARCHES,     // fence pointer searches of disk runs by lookups
+        BYTES_INSERTED,     // pairs written by the user, at their size on disk
+        BYTES_FLUSHED,      // written to level 1 by buffer flushes
+        BYTES_COMPACTED,    // written by merges between disk levels
+        STALLS,             // writes that waited on merges
+        STALL_NANOS,
+        NUM_COUNTERS
+    };
+
+    // per disk level, for lookups that got as far as the level's filters
+    enum LevelCounter {
+        FILTER_NEGATIVES,       // the filter ruled the run out
+        FILTER_TRUE_POSITIVES,  // the run had the key
+        FILTER_FALSE_POSITIVES, // the run was searched for nothing
+        NUM_LEVEL_COUNTERS
+    };
+
+    enum Latency {
+        INSERT_LATENCY,
+        LOOKUP_LATENCY,
+        RANGE_LATENCY,
+        FLUSH_LATENCY,
+        COMPACTION_LATENCY,
+        NUM_LATENCIES
+    };
+
+    static const int MAX_LEVELS = 32;
+    static const unsigned SAMPLE = 8;
+
+    // One thread's counts. Callers that record several things per operation
+    // fetch their shard once with local() and record into it directly.
+    struct Shard {
+        atomic<uint64_t> counters[NUM_COUNTERS];
+        atomic<uint64_t> levels[MAX_LEVELS][NUM_LEVEL_COUNTERS];
+        atomic<uint64_t> latency[NUM_LATENCIES][Histogram::BUCKETS];
+        atomic<uint64_t> latencySum[NUM_LATENCIES];
+        atomic<uint64_t> latencyMax[NUM_LATENCIES];
+        unsigned tick; // operations since the last sampled one
+
+        Shard(): tick(0) {
+            for (int c = 0; c < NUM_COUNTERS; ++c) counters[c].store(0, memory_order_relaxed);
+            for (int l = 0; l < MAX_LEVELS; ++l)
+                for (int c = 0; c < NUM_LEVEL_COUNTERS; ++c) levels[l][c].store(0, memory_order_relaxed);
+            for (int h = 0; h < NUM_LATENCIES; ++h) {
+                for (int b = 0; b < Histogram::BUCKETS; ++b) latency[h][b].store(0, memory_order_relaxed);
+                latencySum[h].store(0, memory_order_relaxed);
+                latencyMax[h].store(0, memory_order_relaxed);
+            }
+        }
+
+        void add(Counter c, uint64_t n = 1) {
+            bump(counters[c], n);
+        }
+
+        void addLevel(LevelCounter c, int level, uint64_t n = 1) {
+            if (level < MAX_LEVELS) {
+                bump(levels[level][c], n);
+            }
+        }
+
+        // should this operation be timed?
+        bool sample() {
+            if (++tick < SAMPLE) {
+                return false;
+            }
+            tick = 0;
+            return true;
+        }
+
+        void record(Latency h, uint64_t nanos) {
+            bump(latency[h][Histogram::bucket(nanos)], 1);
+            bump(latencySum[h], nanos);
+            if (nanos > latencyMax[h].load(memory_order_relaxed)) {
+                latencyMax[h].store(nanos, memory_order_relaxed);
+            }
+        }
+    };
+
+    Metrics(): _id(nextID()) {
+        lock_guard<mutex> l(liveLock());
+        live().insert(_id);
+    }
+
+    ~Metrics() {
+        lock_guard<mutex> l(liveLock());
+        live().erase(_id);
+    }
+
+    void add(Counter c, uint64_t n = 1) {
+        local().add(c, n);
+    }
+
+    void addLevel(LevelCounter c, int level, uint64_t n = 1) {
+        local().addLevel(c, level, n);
+    }
+
+    // latencies of background work, which is rare enough to time every time
+    void record(Latency h, uint64_t nanos) {
+        local().record(h, nanos);
+    }
+
+    MetricsSnapshot snapshot();
+
+    string toJSON();
+
+    static uint64_t now() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static const char *name(Counter c) {
+        static const char *names[] = {"inserts", "lookups", "lookup_hits", "ranges", "fence_searches", "bytes_inserted", "bytes_flushed", "bytes_compacted", "stalls", "stall_nanos"};
+        return names[c];
+    }
+    static const char *name(LevelCounter c) {
+        static const char *names[] = {"filter_negatives", "filter_true_positives", "filter_false_positives"};
+        return names[c];
+    }
+    static const char *name(Latency h) {
+        static const char *names[] = {"insert_ns", "lookup_ns", "range_ns", "flush_ns", "compaction_ns"};
+        return names[h];
+    }
+
+    Shard &local() {
+        // the last registry the thread used, in plain thread-local storage
+        // that needs no construction check
+        static thread_local uint64_t lastID = 0;
+        static thread_local Shard *last = NULL;
+        if (lastID != _id) {
+            last = &find();
+            lastID = _id;
+        }
+        return *last;
+    }
+
+private:
+    uint64_t _id; // registries are told apart by id, as an address may be reused
+    mutex _lock; // guards _shards
+    vector<unique_ptr<Shard>> _shards;
+
+    // only the owning thread writes, so no read-modify-write is needed
+    static void bump(atomic<uint64_t> &a, uint64_t n) {
+        a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    // the thread's shard of each registry it has used; a thread meets a new
+    // registry rarely, so that is when it forgets the ones since destroyed
+    Shard &find() {
+        static thread_local vector<pair<uint64_t, Shard *>> mine;
+        for (size_t i = 0; i < mine.size(); ++i) {
+            if (mine[i].first == _id) {
+                return *mine[i].second;
+            }
+        }
+        {
+            lock_guard<mutex> l(liveLock());
+            size_t kept = 0;
+            for (size_t i = 0; i < mine.size(); ++i) {
+                if (live().count(mine[i].first)) {
+                    mine[kept++] = mine[i];
+                }
+            }
+            mine.resize(kept);
+        }
+        Shard *s = new Shard();
+        {
+            lock_guard<mutex> l(_lock);
+            _shards.push_back(unique_ptr<Shard>(s));
+        }
+        mine.push_back(make_pair(_id, s));
+        return *s;
+    }
+
+    static uint64_t nextID() {
+        static atomic<uint64_t> ids(0);
+        return ++ids;
+    }
+
+    // ids of the registries not yet destroyed
+    static unordered_set<uint64_t> &live() {
+        static unordered_set<uint64_t> ids;
+        return ids;
+    }
+    static mutex &liveLock() {
+        static mutex l;
+        return l;
+    }
+};
+
+struct MetricsSnapshot {
+    uint64_t counters[Metrics::NUM_COUNTERS];
+    vector<vector<uint64_t>> levels; // [level][LevelCounter], up to the deepest level seen
+    Histogram latency[Metrics::NUM_LATENCIES];
+
+    // bytes written to disk per byte the user wrote
+    double writeAmplification() const {
+        uint64_t in = counters[Metrics::BYTES_INSERTED];
+        return in == 0 ? 0 : (double) (counters[Metrics::BYTES_FLUSHED] + counters[Metrics::BYTES_COMPACTED]) / in;
+    }
+
+    // searches of the level's runs that found nothing, per filter query
+    double falsePositiveRate(int level) const {
+        const vector<uint64_t> &l = levels[level];
+        uint64_t negatives = l[Metrics::FILTER_NEGATIVES] + l[Metrics::FILTER_FALSE_POSITIVES];
+        return negatives == 0 ? 0 : (double) l[Metrics::FILTER_FALSE_POSITIVES] / negatives;
+    }
+};
+
+inline MetricsSnapshot Metrics::snapshot() {
+    MetricsSnapshot snap;
+    for (int c = 0; c < NUM_COUNTERS; ++c) {
+        snap.counters[c] = 0;
+    }
+    snap.levels.assign(MAX_LEVELS, vector<uint64_t>(NUM_LEVEL_COUNTERS, 0));
+    lock_guard<mutex> l(_lock);
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        Shard &s = *_shards[i];
+        for (int c = 0; c < NUM_COUNTERS; ++c) {
+            snap.counters[c] += s.counters[c].load(memory_order_relaxed);
+        }
+        for (int lv = 0; lv < MAX_LEVELS; ++lv) {
+            for (int c = 0; c < NUM_LEVEL_COUNTERS; ++c) {
+                snap.levels[lv][c] += s.levels[lv][c].load(memory_order_relaxed);
+            }
+        }
+        for (int h = 0; h < NUM_LATENCIES; ++h) {
+            Histogram part;
+            for (int b = 0; b < Histogram::BUCKETS; ++b) {
+                uint64_t n = s.latency[h][b].load(memory_order_relaxed);
+                if (n > 0) {
+                    part.add(b, n, 0);
+                }
+            }
+            part.add(0, 0, s.latencySum[h].load(memory_order_relaxed));
+            part.setMax(s.latencyMax[h].load(memory_order_relaxed));
+            snap.latency[h].merge(part);
+        }
+    }
+    while (!snap.levels.empty()) {
+        const vector<uint64_t> &last = snap.levels.back();
+        if (last[FILTER_NEGATIVES] + last[FILTER_TRUE_POSITIVES] + last[FILTER_FALSE_POSITIVES] != 0) {
+            break;
+        }
+        snap.levels.pop_back();
+    }
+    return snap;
+}
+
+inline string Metrics::toJSON() {
+    MetricsSnapshot snap = snapshot();
+    ostringstream out;
+    out << "{\"counters\":{";
+    for (int c = 0; c < NUM_COUNTERS; ++c) {
+        out << (c ? "," : "") << "\"" << name((Counter) c) << "\":" << snap.counters[c];
+    }
+    out << "},\"write_amplification\":" << snap.writeAmplification();
+    out << ",\"levels\":[";
+    for (size_t lv = 0; lv < snap.levels.size(); ++lv) {
+        out << (lv ? "," : "") << "{\"level\":" << lv + 1;
+        for (int c = 0; c < NUM_LEVEL_COUNTERS; ++c) {
+            out << ",\"" << name((LevelCounter) c) << "\":" << snap.levels[lv][c];
+        }
+        out << ",\"false_positive_rate\":" << snap.falsePositiveRate((int) lv) << "}";
+    }
+    out << "],\"latency\":{";
+    for (int h = 0; h < NUM_LATENCIES; ++h) {
+        const Histogram &hist = snap.latency[h];
+        out << (h ? "," : "") << "\"" << name((Latency) h) << "\":{\"count\":" << hist.count() << ",\"mean\":" << hist.mean()
+            << ",\"p50\":" << hist.percentile(0.5) << ",\"p99\":" << hist.percentile(0.99) << ",\"p999\":" << hist.percentile(0.999)
+            << ",\"max\":" << hist.maxValue() << "}";
+    }
+    out << "}}";
+    return out.str();
+}
+
+#endif /* metrics_h */
@@ -0,0 +1,315 @@
+//
+//  microbench.cpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  Microbenchmarks of the tree's building blocks, one at a time: `make
+//  microbench`, then
+//
+//      ./microbench.out [filter=NAME] [sizes=1000,100000] [reps=7] [warmup=2] [seed=42]
+//
+//  Every case is run warmup times untimed and then reps times timed, each
+//  time on fresh inputs built outside the timed region; the CSV on stdout
+//  gives the median, mean, standard deviation and range of ns per operation
+//  over the timed repetitions. filter keeps the cases whose component name
+//  contains NAME.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include "lsm.hpp"
+#include "hashMap.hpp"
+
+using namespace std;
+
+struct Options {
+    vector<unsigned long> sizes = {1000, 100000, 1000000};
+    unsigned reps = 7;
+    unsigned warmup = 2;
+    unsigned long seed = 42;
+    string filter;
+};
+
+static Options opts;
+static volatile unsigned long sink; // keeps results of the timed code alive
+
+enum Distribution { UNIFORM, SEQUENTIAL };
+static const char *distNames[] = {"uniform", "sequential"};
+
+// n distinct keys in [1, 2^30), in the order the distribution visits them
+static vector<int> makeKeys(unsigned long n, Distribution d, mt19937 &rng){
+    vector<int> keys(n);
+    if (d == SEQUENTIAL) {
+        for (unsigned long i = 0; i < n; i++) keys[i] = (int) (i + 1);
+        return keys;
+    }
+    // a random 30-bit bijection keeps the keys distinct
+    unsigned long mul = (rng() | 1), add = rng();
+    for (unsigned long i = 0; i < n; i++) {
+        keys[i] = (int) (((i + 1) * mul + add) & 0x3fffffff) | 1;
+    }
+    return keys;
+}
+
+// the keys in a different random order, to look them up in
+static vector<int> shuffled(vector<int> keys, mt19937 &rng){
+    shuffle(keys.begin(), keys.end(), rng);
+    return keys;
+}
+
+// keys that are not in makeKeys' output: those are all odd
+static vector<int> missingKeys(unsigned long n, mt19937 &rng){
+    vector<int> keys(n);
+    for (unsigned long i = 0; i < n; i++) {
+        keys[i] = (int) (rng() & 0x3ffffffe);
+    }
+    return keys;
+}
+
+// One benchmark case. setup() builds the inputs of one repetition and
+// returns the operation to time, which reports how many operations it did.
+struct Case {
+    string component;
+    string operation;
+    unsigned long size;
+    string distribution;
+    function<function<unsigned long()>()> setup;
+};
+
+static void runCase(const Case &c){
+    if (!opts.filter.empty() && c.component.find(opts.filter) == string::npos) {
+        return;
+    }
+    vector<double> nsPerOp;
+    for (unsigned r = 0; r < opts.warmup + opts.reps; r++) {
+        function<unsigned long()> body = c.setup();
+        auto started = chrono::steady_clock::now();
+        unsigned long ops = body();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - started).count();
+        if (r >= opts.warmup) {
+            nsPerOp.push_back(ns / max(ops, 1ul));
+        }
+    }
+    sort(nsPerOp.begin(), nsPerOp.end());
+    double mean = 0, var = 0;
+    for (size_t i = 0; i < nsPerOp.size(); i++) mean += nsPerOp[i];
+    mean /= nsPerOp.size();
+    for (size_t i = 0; i < nsPerOp.size(); i++) var += (nsPerOp[i] - mean) * (nsPerOp[i] - mean);
+    double stddev = nsPerOp.size() > 1 ? sqrt(var / (nsPerOp.size() - 1)) : 0;
+    size_t m = nsPerOp.size() / 2;
+    double median = nsPerOp.size() % 2 ? nsPerOp[m] : (nsPerOp[m - 1] + nsPerOp[m]) / 2;
+    cout << c.component << "," << c.operation << "," << c.size << "," << c.distribution << "," << nsPerOp.size() << ","
+         << median << "," << mean << "," << stddev << "," << nsPerOp.front() << "," << nsPerOp.back() << "," << 1000 / median << endl;
+}
+
+template <class List>
+static void skipListCases(const string &name){
+    for (unsigned long n : opts.sizes) {
+        for (int d = 0; d < 2; d++) {
+            Distribution dist = (Distribution) d;
+            runCase({name, "insert_key", n, distNames[d], [n, dist]{
+                mt19937 rng(opts.seed);
+                auto keys = make_shared<vector<int>>(makeKeys(n, dist, rng));
+                auto list = make_shared<List>(INT32_MIN, INT32_MAX);
+                list->set_size(n);
+                return [keys, list]{
+                    for (size_t i = 0; i < keys->size(); i++) list->insert_key((*keys)[i], (int) i);
+                    return (unsigned long) keys->size();
+                };
+            }});
+            runCase({name, "lookup_hit", n, distNames[d], [n, dist]{
+                mt19937 rng(opts.seed);
+                vector<int> keys = makeKeys(n, dist, rng);
+                auto list = make_shared<List>(INT32_MIN, INT32_MAX);
+                list->set_size(n);
+                for (size_t i = 0; i < keys.size(); i++) list->insert_key(keys[i], (int) i);
+                auto probes = make_shared<vector<int>>(dist == SEQUENTIAL ? keys : shuffled(keys, rng));
+                return [probes, list]{
+                    unsigned long hits = 0;
+                    for (size_t i = 0; i < probes->size(); i++) {
+                        bool found = false;
+                        list->lookup((*probes)[i], found);
+                        hits += found;
+                    }
+                    sink = hits;
+                    return (unsigned long) probes->size();
+                };
+            }});
+        }
+    }
+}
+
+template <class Filter>
+static void filterCases(const string &name){
+    for (unsigned long n : opts.sizes) {
+        runCase({name, "add", n, "uniform", [n]{
+            mt19937 rng(opts.seed);
+            auto keys = make_shared<vector<int>>(makeKeys(n, UNIFORM, rng));
+            auto bf = make_shared<Filter>(n, 0.01);
+            return [keys, bf]{
+                for (size_t i = 0; i < keys->size(); i++) bf->add(&(*keys)[i], sizeof(int));
+                return (unsigned long) keys->size();
+            };
+        }});
+        for (int hit = 0; hit < 2; hit++) {
+            runCase({name, hit ? "mayContain_hit" : "mayContain_miss", n, "uniform", [n, hit]{
+                mt19937 rng(opts.seed);
+                vector<int> keys = makeKeys(n, UNIFORM, rng);
+                auto bf = make_shared<Filter>(n, 0.01);
+                for (size_t i = 0; i < keys.size(); i++) bf->add(&keys[i], sizeof(int));
+                auto probes = make_shared<vector<int>>(hit ? shuffled(keys, rng) : missingKeys(n, rng));
+                return [probes, bf]{
+                    unsigned long yes = 0;
+                    for (size_t i = 0; i < probes->size(); i++) yes += bf->mayContain(&(*probes)[i], sizeof(int));
+                    sink = yes;
+                    return (unsigned long) probes->size();
+                };
+            }});
+        }
+    }
+}
+
+static void hashTableCases(){
+    for (unsigned long n : opts.sizes) {
+        for (int d = 0; d < 2; d++) {
+            Distribution dist = (Distribution) d;
+            runCase({"HashTable", "putIfEmpty", n, distNames[d], [n, dist]{
+                mt19937 rng(opts.seed);
+                auto keys = make_shared<vector<int>>(makeKeys(n, dist, rng));
+                auto table = make_shared<HashTable<int, int>>(n);
+                return [keys, table]{
+                    unsigned long fresh = 0;
+                    for (size_t i = 0; i < keys->size(); i++) fresh += table->putIfEmpty((*keys)[i], (int) i + 1) == 0;
+                    sink = fresh;
+                    return (unsigned long) keys->size();
+                };
+            }});
+        }
+    }
+}
+
+static void diskRunCases(){
+    typedef DiskRun<int, int> Run_t;
+    for (unsigned long n : opts.sizes) {
+        for (unsigned pageSize : {64u, 512u, 4096u}) {
+            ostringstream op;
+            op << "get_index_page" << pageSize;
+            runCase({"DiskRun", op.str(), n, "uniform", [n, pageSize]{
+                mt19937 rng(opts.seed);
+                vector<int> keys = makeKeys(n, UNIFORM, rng);
+                vector<KVPair<int, int>> pairs(n);
+                vector<int> sorted = keys;
+                sort(sorted.begin(), sorted.end());
+                for (unsigned long i = 0; i < n; i++) pairs[i] = {sorted[i], (int) i};
+                auto run = make_shared<Run_t>(n, pageSize, 999, 0, 0.01);
+                run->writeData(&pairs[0], 0, n);
+                run->constructIndex();
+                auto probes = make_shared<vector<int>>(shuffled(keys, rng));
+                return [probes, run]{
+                    unsigned long hits = 0;
+                    for (size_t i = 0; i < probes->size(); i++) {
+                        bool found = false;
+                        run->get_index((*probes)[i], found);
+                        hits += found;
+                    }
+                    sink = hits;
+                    return (unsigned long) probes->size();
+                };
+            }});
+        }
+    }
+}
+
+// LoserTree took over from StaticHeap as the k-way merge of disk runs
+static void loserTreeCases(){
+    typedef KVPair<int, int> Pair;
+    for (unsigned long n : opts.sizes) {
+        for (unsigned k : {2u, 8u, 32u}) {
+            ostringstream op;
+            op << "merge_k" << k;
+            runCase({"LoserTree", op.str(), n, "uniform", [n, k]{
+                mt19937 rng(opts.seed);
+                vector<int> keys = makeKeys(n, UNIFORM, rng);
+                auto inputs = make_shared<vector<vector<Pair>>>(k);
+                for (unsigned long i = 0; i < n; i++) (*inputs)[i % k].push_back({keys[i], (int) i});
+                for (unsigned j = 0; j < k; j++) {
+                    sort((*inputs)[j].begin(), (*inputs)[j].end(), [](const Pair &a, const Pair &b){ return a.key < b.key; });
+                }
+                auto out = make_shared<vector<Pair>>(n);
+                return [inputs, out, n]{
+                    vector<LoserTree<int, int>::Input> in;
+                    for (size_t j = 0; j < inputs->size(); j++) {
+                        in.push_back({(*inputs)[j].data(), (*inputs)[j].size()});
+                    }
+                    LoserTree<int, int> tree(in);
+                    sink = tree.merge(out->data(), n, INT_MIN, false);
+                    return n;
+                };
+            }});
+        }
+    }
+}
+
+static void usage(const string &why){
+    cerr << "microbench: " << why << endl;
+    cerr << "usage: microbench.out [filter=NAME] [sizes=N,N,...] [reps=N] [warmup=N] [seed=N]" << endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == string::npos) usage("expected key=value, got " + arg);
+        string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+        if (key == "filter") opts.filter = value;
+        else if (key == "reps") opts.reps = stoul(value);
+        else if (key == "warmup") opts.warmup = stoul(value);
+        else if (key == "seed") opts.seed = stoul(value);
+        else if (key == "sizes") {
+            opts.sizes.clear();
+            istringstream in(value);
+            string n;
+            while (getline(in, n, ',')) opts.sizes.push_back(stoul(n));
+        }
+        else usage("unknown setting " + key);
+    }
+    if (opts.reps == 0 || opts.sizes.empty()) {
+        usage("need at least one size and one repetition");
+    }
+
+    cout << "component,operation,size,distribution,reps,median_ns,mean_ns,stddev_ns,min_ns,max_ns,mops_per_sec" << endl;
+    skipListCases<SkipList<int, int>>("SkipList");
+    skipListCases<ConcurrentSkipList<int, int>>("ConcurrentSkipList");
+    filterCases<BloomFilter<int>>("BloomFilter");
+    filterCases<BlockedBloomFilter<int>>("BlockedBloomFilter");
+    hashTableCases();
+    diskRunCases();
+    loserTreeCases();
+    return 0;
+}
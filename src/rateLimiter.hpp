@@ -0,0 +1,73 @@
+//
+//  rateLimiter.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef rateLimiter_h
+#define rateLimiter_h
+#include <mutex>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+// Token bucket. Tokens accrue at `rate` per second up to `burst`; request(n)
+// takes n of them, and if that leaves the bucket in debt the caller sleeps
+// until the debt would be paid off. Callers that arrive while the bucket is in
+// debt add to it, so concurrent callers are served in arrival order at `rate`
+// overall. A rate of 0 means unlimited.
+class RateLimiter {
+public:
+    RateLimiter(double rate, double burst): _rate(rate), _burst(burst), _tokens(burst), _last(chrono::steady_clock::now()) {}
+
+    void request(double n) {
+        if (_rate <= 0) {
+            return;
+        }
+        double wait;
+        {
+            lock_guard<mutex> l(_lock);
+            auto now = chrono::steady_clock::now();
+            _tokens += chrono::duration<double>(now - _last).count() * _rate;
+            if (_tokens > _burst) {
+                _tokens = _burst;
+            }
+            _last = now;
+            _tokens -= n;
+            wait = _tokens < 0 ? -_tokens / _rate : 0;
+        }
+        if (wait > 0) {
+            this_thread::sleep_for(chrono::duration<double>(wait));
+        }
+    }
+
+    double rate() const {
+        return _rate;
+    }
+
+private:
+    double _rate;
+    double _burst;
+    double _tokens;
+    chrono::steady_clock::time_point _last;
+    mutex _lock;
+};
+
+#endif /* rateLimiter_h */
@@ -28,8 +28,12 @@
 #include <random>
 #include <vector>
 #include <string>
+#include <new>
+#include <type_traits>
 
 #include "run.hpp"
+#include "arena.hpp"
+#include "interleave.hpp"
 using namespace std;
 
 default_random_engine generator;
@@ -37,6 +41,9 @@ uniform_real_distribution<double> distribution(0.0,1.0);
 const double NODE_PROBABILITY = 0.5;
 
 
+// Nodes are laid out with exactly as many forward pointers as their height
+// and live in the list's arena, so there is no per-node malloc or vtable and a
+// whole run is released in one go. _forward[i] is the link on level i + 1.
 template<class K,class V, unsigned MAXLEVEL>
 class SkipList_Node {
    
@@ -45,22 +52,28 @@ class SkipList_Node {
 public:
     const K key;
     V value;
-    SkipList_Node<K,V,MAXLEVEL>* _forward[MAXLEVEL+1];
+    int height;
+    SkipList_Node<K,V,MAXLEVEL>* _forward[1];
     
+    static SkipList_Node * create(Arena &arena, const K searchKey, const V val, const int h) {
+        void *mem = arena.allocate(sizeof(SkipList_Node) + (h - 1) * sizeof(SkipList_Node *), alignof(SkipList_Node));
+        return new (mem) SkipList_Node(searchKey, val, h);
+    }
     
-    SkipList_Node(const K searchKey):key(searchKey) {
-        for (int i=1; i<=MAXLEVEL; i++) {
-            _forward[i] = NULL;
-        }
+    inline SkipList_Node * next(int level) {
+        return _forward[level - 1];
     }
     
-    SkipList_Node(const K searchKey,const V val):key(searchKey),value(val) {
-        for (int i=1; i<=MAXLEVEL; i++) {
+    inline void setNext(int level, SkipList_Node *node) {
+        _forward[level - 1] = node;
+    }
+    
+private:
+    SkipList_Node(const K searchKey,const V val, const int h):key(searchKey),value(val),height(h) {
+        for (int i=0; i<h; i++) {
             _forward[i] = NULL;
         }
     }
-    
-    virtual ~SkipList_Node(){}
 };
 
 
@@ -70,6 +83,7 @@ class SkipList : public Run<K,V>
 public:
     
     typedef SkipList_Node<K,V,MAXLEVEL> Node;
+    static const bool concurrent = false; // single writer only, see concurrentSkipList.hpp
 
     const int max_level;
     K min;
@@ -79,23 +93,24 @@ public:
     cur_max_level(1),max_level(MAXLEVEL), min((K) NULL), max((K) NULL),
     _minKey(minKey),_maxKey(maxKey), _n(0)
     {
-        p_listHead = new Node(_minKey);
-        p_listTail = new Node(_maxKey);
+        p_listHead = Node::create(_arena, _minKey, (V) NULL, MAXLEVEL);
+        p_listTail = Node::create(_arena, _maxKey, (V) NULL, 1);
         for (int i=1; i<=MAXLEVEL; i++) {
-            p_listHead->_forward[i] = p_listTail;
+            p_listHead->setNext(i, p_listTail);
         }
     }
     
     ~SkipList()
     {
-        Node* currNode = p_listHead->_forward[1];
-        while (currNode != p_listTail) {
-            Node* tempNode = currNode;
-            currNode = currNode->_forward[1];
-            delete tempNode;
+        // the arena frees every node at once; only non-trivial keys/values need visiting
+        if (!is_trivially_destructible<K>::value || !is_trivially_destructible<V>::value) {
+            Node* currNode = p_listHead;
+            while (currNode != NULL) {
+                Node* tempNode = currNode;
+                currNode = currNode == p_listTail ? NULL : currNode->next(1);
+                tempNode->~Node();
+            }
         }
-        delete p_listHead;
-        delete p_listTail;
     }
     
     void insert_key(const K &key, const V &value) {
@@ -105,15 +120,15 @@ public:
         else if (key < min){
             min = key;
         }
-        Node* update[MAXLEVEL];
+        Node* update[MAXLEVEL+1];
         Node* currNode = p_listHead;
         for(int level = cur_max_level; level > 0; level--) {
-            while (currNode->_forward[level]->key < key) {
-                currNode = currNode->_forward[level];
+            while (currNode->next(level)->key < key) {
+                currNode = currNode->next(level);
             }
             update[level] = currNode;
         }
-        currNode = currNode->_forward[1];
+        currNode = currNode->next(1);
         if (currNode->key == key) {
             // update the value if the key already exists
             currNode->value = value;
@@ -122,16 +137,16 @@ public:
             // if key isn't in the list, insert a new node!
             int insertLevel = generateNodeLevel();
             
-            if (insertLevel > cur_max_level && insertLevel < MAXLEVEL - 1) {
+            if (insertLevel > cur_max_level) {
                 for (int lv = cur_max_level + 1; lv <= insertLevel; lv++) {
                     update[lv] = p_listHead;
                 }
                 cur_max_level = insertLevel;
             }
-            currNode = new Node(key,value);
-            for (int level = 1; level <= cur_max_level; level++) {
-                currNode->_forward[level] = update[level]->_forward[level];
-                update[level]->_forward[level] = currNode;
+            currNode = Node::create(_arena, key, value, insertLevel);
+            for (int level = 1; level <= insertLevel; level++) {
+                currNode->setNext(level, update[level]->next(level));
+                update[level]->setNext(level, currNode);
             }
             ++_n;
 
@@ -141,40 +156,37 @@ public:
     }
     
     void delete_key(const K &searchKey) {
-        //            SkipList_Node<K,V,MAXLEVEL>* update[MAXLEVEL];
-        Node* update[MAXLEVEL];
+        Node* update[MAXLEVEL+1];
         Node* currNode = p_listHead;
         for(int level=cur_max_level; level >=1; level--) {
-            while (currNode->_forward[level]->key < searchKey) {
-                currNode = currNode->_forward[level];
+            while (currNode->next(level)->key < searchKey) {
+                currNode = currNode->next(level);
             }
             update[level] = currNode;
         }
-        currNode = currNode->_forward[1];
+        currNode = currNode->next(1);
         if (currNode->key == searchKey) {
-            for (int level = 1; level <= cur_max_level; level++) {
-                if (update[level]->_forward[level] != currNode) {
-                    break;
-                }
-                update[level]->_forward[level] = currNode->_forward[level];
+            for (int level = 1; level <= currNode->height; level++) {
+                update[level]->setNext(level, currNode->next(level));
             }
-            delete currNode;
+            // the node's memory stays in the arena until the run is freed
+            currNode->~Node();
             // update the max level
-            while (cur_max_level > 1 && p_listHead->_forward[cur_max_level] == NULL) {
+            while (cur_max_level > 1 && p_listHead->next(cur_max_level) == p_listTail) {
                 cur_max_level--;
             }
+            _n--;
         }
-        _n--;
     }
     
     V lookup(const K &searchKey, bool &found) {
         Node* currNode = p_listHead;
         for(int level=cur_max_level; level >=1; level--) {
-            while (currNode->_forward[level]->key < searchKey) {
-                currNode = currNode->_forward[level];
+            while (currNode->next(level)->key < searchKey) {
+                currNode = currNode->next(level);
             }
         }
-        currNode = currNode->_forward[1];
+        currNode = currNode->next(1);
         if (currNode->key == searchKey) {
             found = true;
             return currNode->value;
@@ -184,14 +196,39 @@ public:
         }
     }
     
+#ifdef LSM_COROUTINES
+    // lookup, yielding before each node it has not visited yet (see interleave.hpp)
+    LookupTask<LookupResult<V>> lookupTask(const K searchKey) {
+        Node* currNode = p_listHead;
+        Node* stoppedAt = NULL; // the node that ended the search on the level above
+        for(int level=cur_max_level; level >=1; level--) {
+            Node* next = currNode->next(level);
+            if (next != stoppedAt) {
+                co_await prefetchAndYield(next);
+            }
+            while (next->key < searchKey) {
+                currNode = next;
+                next = currNode->next(level);
+                co_await prefetchAndYield(next);
+            }
+            stoppedAt = next;
+        }
+        currNode = currNode->next(1);
+        if (currNode->key == searchKey) {
+            co_return LookupResult<V>{true, currNode->value};
+        }
+        co_return LookupResult<V>{false, (V) NULL};
+    }
+#endif
+    
     vector<KVPair<K,V>> get_all(){
         vector<KVPair<K,V>> vec = vector<KVPair<K, V>>();
-        auto node = p_listHead->_forward[1];
+        vec.reserve(_n);
+        auto node = p_listHead->next(1);
         while ( node != p_listTail){
             KVPair<K,V> kv = {node->key, node->value};
             vec.push_back(kv);
-            // TODO: optimize by reserving space before hand
-            node = node->_forward[1];
+            node = node->next(1);
         }
         return vec;
     }
@@ -202,15 +239,15 @@ public:
         }
         
         vector<KVPair<K,V>> vec = vector<KVPair<K, V>>();
-        auto node = p_listHead->_forward[1];
+        auto node = p_listHead->next(1);
         while ( node->key < key1){
-            node = node->_forward[1];
+            node = node->next(1);
         }
 
         while ( node->key < key2){
             KVPair<K,V> kv = {node->key, node->value};
             vec.push_back(kv);
-            node = node->_forward[1];
+            node = node->next(1);
         }
         return vec;
         
@@ -218,12 +255,53 @@ public:
     }
 
     
+    // Forward cursor over the list in key order, so runs can be merged or
+    // scanned without copying them out. Valid for as long as the list is.
+    class Cursor {
+    public:
+        Cursor(): _node(NULL), _tail(NULL) {}
+        
+        bool valid() const {
+            return _node != _tail;
+        }
+        const K &key() const {
+            return _node->key;
+        }
+        const V &value() const {
+            return _node->value;
+        }
+        void next() {
+            _node = _node->next(1);
+        }
+        
+    private:
+        friend class SkipList;
+        Cursor(Node *node, Node *tail): _node(node), _tail(tail) {}
+        Node *_node;
+        Node *_tail;
+    };
+    
+    Cursor begin() {
+        return Cursor(p_listHead->next(1), p_listTail);
+    }
+    
+    // cursor at the first key >= searchKey
+    Cursor seek(const K &searchKey) {
+        Node* currNode = p_listHead;
+        for(int level=cur_max_level; level >=1; level--) {
+            while (currNode->next(level)->key < searchKey) {
+                currNode = currNode->next(level);
+            }
+        }
+        return Cursor(currNode->next(1), p_listTail);
+    }
+    
     bool eltIn(K &key) {
         return lookup(key);
     }
     
     inline bool empty() {
-        return (p_listHead->_forward[1] == p_listTail);
+        return (p_listHead->next(1) == p_listTail);
     }
     
     
@@ -247,13 +325,24 @@ public:
         return _n * (sizeof(K) + sizeof(V));
     }
     
+    // memory actually held by the run's nodes, including forward pointers
+    size_t get_arena_bytes(){
+        return _arena.bytes_reserved();
+    }
+    
+    size_t get_memory_bytes(){
+        return get_arena_bytes();
+    }
+    
     //    private:
     
     int generateNodeLevel() {
-        
-        return ffs(rand() & ((1 << MAXLEVEL) - 1)) - 1;
+        // geometric with p = 1/2, capped at MAXLEVEL
+        int level = ffs(rand() & ((1 << MAXLEVEL) - 1));
+        return level ? level : MAXLEVEL;
     }
     
+    Arena _arena;
     K _minKey;
     K _maxKey;
     unsigned long long _n;
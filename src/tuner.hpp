@@ -0,0 +1,148 @@
+//
+//  tuner.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef tuner_h
+#define tuner_h
+#include <atomic>
+#include <vector>
+#include <cmath>
+
+using namespace std;
+
+// The shape of the memory buffer: numRuns skiplists of eltsPerRun pairs, of
+// which ceil(mergedFrac * numRuns) are flushed together.
+struct BufferShape {
+    unsigned numRuns;
+    unsigned long eltsPerRun;
+    double mergedFrac;
+
+    unsigned numToMerge() const {
+        return (unsigned) ceil(mergedFrac * numRuns);
+    }
+    unsigned long batch() const {
+        return numToMerge() * eltsPerRun;
+    }
+    bool operator==(const BufferShape &other) const {
+        return numRuns == other.numRuns && eltsPerRun == other.eltsPerRun && numToMerge() == other.numToMerge();
+    }
+};
+
+// Counts the operations the tree serves and, every so often, picks the
+// buffer shape a cost model says is cheapest for the mix it saw. The buffer
+// keeps its memory (numRuns * eltsPerRun pairs) and a flush never carries more
+// than maxBatch pairs, the most level 1 was built to take in. The tree asks
+// at every buffer flush (see LSM::do_merge) and reshapes the buffer when the
+// answer changes; the disk levels keep the shape they were built with.
+//
+// Costs are in cache misses per operation:
+//   insert  log2(eltsPerRun) skiplist hops, plus the flush's fixed overhead
+//           spread over its batch, plus a sequential pass per level the pair
+//           is merged through, of which a smaller batch makes more
+//   lookup  a filter probe per buffer run and a skiplist search
+//   range   a skiplist seek per buffer run and a merge of that many sources
+// so a write-heavy mix wants many short runs and a read- or scan-heavy mix few
+// long ones.
+class AutoTuner {
+public:
+    AutoTuner(unsigned long bufferElts, unsigned long maxBatch, unsigned long interval): _bufferElts(bufferElts), _maxBatch(maxBatch), _interval(interval), _inserts(0), _lookups(0), _ranges(0), _seen(0) {}
+
+    void countInsert() {
+        _inserts.fetch_add(1, memory_order_relaxed);
+    }
+    void countLookup(unsigned long n = 1) {
+        _lookups.fetch_add(n, memory_order_relaxed);
+    }
+    void countRange() {
+        _ranges.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Once interval operations have gone by since the last decision, weigh
+    // the mix since then and return the shape to switch to, or `current` if
+    // none is cheaper by enough to be worth rebuilding the buffer for.
+    // treeElts is the number of pairs on disk. Called by one thread at a time.
+    BufferShape retune(const BufferShape &current, unsigned long treeElts, unsigned sizeRatio) {
+        unsigned long inserts = _inserts.load(memory_order_relaxed);
+        unsigned long lookups = _lookups.load(memory_order_relaxed);
+        unsigned long ranges = _ranges.load(memory_order_relaxed);
+        unsigned long total = inserts + lookups + ranges;
+        if (total - _seen < _interval) {
+            return current;
+        }
+        double ops = (double) (total - _seen);
+        double w = (inserts - _last[0]) / ops, r = (lookups - _last[1]) / ops, s = (ranges - _last[2]) / ops;
+        _seen = total;
+        _last[0] = inserts;
+        _last[1] = lookups;
+        _last[2] = ranges;
+
+        BufferShape best = current;
+        double bestCost = cost(current, w, r, s, treeElts, sizeRatio);
+        double currentCost = bestCost;
+        for (unsigned numRuns = 2; numRuns <= MAX_RUNS; numRuns *= 2) {
+            if (_bufferElts / numRuns < MIN_RUN) {
+                break;
+            }
+            const double fracs[] = {0.25, 0.5, 1.0};
+            for (int f = 0; f < 3; f++) {
+                BufferShape shape = {numRuns, _bufferElts / numRuns, fracs[f]};
+                if (shape.batch() > _maxBatch) {
+                    continue;
+                }
+                double c = cost(shape, w, r, s, treeElts, sizeRatio);
+                if (c < bestCost) {
+                    best = shape;
+                    bestCost = c;
+                }
+            }
+        }
+        // rebuilding the buffer flushes all of it, so small wins are not worth it
+        return bestCost < currentCost * (1 - HYSTERESIS) ? best : current;
+    }
+
+    static double cost(const BufferShape &shape, double w, double r, double s, unsigned long treeElts, unsigned sizeRatio) {
+        double hops = log2((double) shape.eltsPerRun);
+        double batch = (double) shape.batch();
+        double levels = treeElts > batch ? log((double) treeElts / batch) / log((double) max(sizeRatio, 2u)) + 1 : 1;
+        double insert = hops + FLUSH_OVERHEAD / batch + MERGE_PASS * levels;
+        double lookup = shape.numRuns + hops;
+        double range = shape.numRuns * (hops + log2((double) shape.numRuns));
+        return w * insert + r * lookup + s * range;
+    }
+
+private:
+    static const unsigned MAX_RUNS = 64;
+    static const unsigned long MIN_RUN = 64; // shortest run worth a skiplist of its own
+    static constexpr double FLUSH_OVERHEAD = 4096; // run files, mmap, filter and fence pointers
+    static constexpr double MERGE_PASS = 0.25; // a pair's share of a sequential merge pass
+    static constexpr double HYSTERESIS = 0.1;
+
+    unsigned long _bufferElts;
+    unsigned long _maxBatch;
+    unsigned long _interval;
+    atomic<unsigned long> _inserts;
+    atomic<unsigned long> _lookups;
+    atomic<unsigned long> _ranges;
+    unsigned long _seen; // operations up to the last decision
+    unsigned long _last[3] = {0, 0, 0};
+};
+
+#endif /* tuner_h */
@@ -0,0 +1,308 @@
+//
+//  wal.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef wal_h
+#define wal_h
+#include <stdio.h>
+#include <stdlib.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "run.hpp"
+#include "MurmurHash.h"
+
+using namespace std;
+
+enum WALSyncPolicy {
+    WAL_SYNC_NONE,      // records reach the OS when the log buffer fills or rolls over; never fsynced
+    WAL_SYNC_INTERVAL,  // a background thread writes and fsyncs the log every walSyncIntervalMs
+    WAL_SYNC_BATCH      // every insert waits for an fsync covering it; concurrent inserts share one (group commit)
+};
+
+// Write-ahead log for the memory buffer. The log is a sequence of segment
+// files, wal_<id>.log, and the LSM starts a new segment whenever it moves on
+// to a new buffer run, so each segment holds the records of exactly one run.
+// Once a batch of runs is durable on disk the LSM releases their segments.
+template <class K, class V>
+class WriteAheadLog {
+public:
+    struct Record {
+        K key;
+        V value;
+        uint32_t check;
+    };
+
+    WriteAheadLog(const string &dir, WALSyncPolicy policy, unsigned syncIntervalMs):_dir(dir), _policy(policy), _syncIntervalMs(syncIntervalMs), _fd(-1), _appended(0), _durable(0), _syncing(false), _stop(false) {
+        if (mkdir(_dir.c_str(), 0700) == -1 && errno != EEXIST) {
+            perror(("Error creating log directory " + _dir).c_str());
+            exit(EXIT_FAILURE);
+        }
+        _recovered = existingSegments();
+        _segment = _recovered.empty() ? 0 : _recovered.back() + 1;
+        _oldestLive = _segment;
+        openSegment(_segment);
+        if (_policy == WAL_SYNC_INTERVAL) {
+            _syncThread = thread(&WriteAheadLog::syncLoop, this);
+        }
+    }
+
+    ~WriteAheadLog() {
+        if (_syncThread.joinable()) {
+            {
+                lock_guard<mutex> l(_bufLock);
+                _stop = true;
+            }
+            _stopCond.notify_all();
+            _syncThread.join();
+        }
+        flush(_policy != WAL_SYNC_NONE);
+        close(_fd);
+    }
+
+    // log one insert (deletes are inserts of the tombstone value) and return
+    // its LSN. The record is not durable until commit(lsn) has returned.
+    uint64_t append(const K &key, const V &value) {
+        Record rec;
+        memset(&rec, 0, sizeof(Record));
+        rec.key = key;
+        rec.value = value;
+        rec.check = checksum(rec);
+        lock_guard<mutex> l(_bufLock);
+        _buffer.insert(_buffer.end(), (char *) &rec, (char *) &rec + sizeof(Record));
+        return ++_appended;
+    }
+    
+    // under WAL_SYNC_BATCH, wait until the record is on stable storage;
+    // otherwise just keep the in-memory buffer from growing without bound
+    void commit(uint64_t lsn) {
+        if (_policy == WAL_SYNC_BATCH) {
+            waitDurable(lsn);
+            return;
+        }
+        size_t buffered;
+        {
+            lock_guard<mutex> l(_bufLock);
+            buffered = _buffer.size();
+        }
+        if (buffered >= BUFFER_LIMIT) {
+            flush(false);
+        }
+    }
+
+    // close the current segment and start the next one; returns the new segment's id
+    uint64_t rotate() {
+        lock_guard<mutex> io(_ioLock);
+        writeBuffered(_policy != WAL_SYNC_NONE);
+        close(_fd);
+        openSegment(++_segment);
+        return _segment;
+    }
+
+    uint64_t current_segment() {
+        lock_guard<mutex> io(_ioLock);
+        return _segment;
+    }
+
+    // the runs logged in segments up to and including upTo are durable elsewhere
+    void release(uint64_t upTo) {
+        lock_guard<mutex> io(_ioLock);
+        for (; _oldestLive <= upTo && _oldestLive < _segment; ++_oldestLive) {
+            string name = segmentName(_oldestLive);
+            if (unlink(name.c_str()) == -1 && errno != ENOENT) {
+                perror(("Error removing log segment " + name).c_str());
+            }
+        }
+    }
+
+    // feed every record left behind by a previous process to apply, oldest
+    // first. apply is expected to re-log what it inserts; the old segments are
+    // deleted only after the new log holding their records is synced.
+    template <class F>
+    void replay(F apply) {
+        for (size_t s = 0; s < _recovered.size(); ++s) {
+            string name = segmentName(_recovered[s]);
+            FILE *f = fopen(name.c_str(), "rb");
+            if (f == NULL) {
+                perror(("Error opening log segment " + name).c_str());
+                exit(EXIT_FAILURE);
+            }
+            Record rec;
+            while (fread(&rec, sizeof(Record), 1, f) == 1) {
+                if (rec.check != checksum(rec)) {
+                    break; // torn write at the tail of the segment
+                }
+                apply(rec.key, rec.value);
+            }
+            fclose(f);
+        }
+        flush(true);
+        for (size_t s = 0; s < _recovered.size(); ++s) {
+            unlink(segmentName(_recovered[s]).c_str());
+        }
+        _recovered.clear();
+    }
+
+    // write out everything appended so far, optionally fsyncing it
+    void flush(bool sync) {
+        lock_guard<mutex> io(_ioLock);
+        writeBuffered(sync);
+    }
+
+private:
+    static const size_t BUFFER_LIMIT = 1 << 16;
+
+    string _dir;
+    WALSyncPolicy _policy;
+    unsigned _syncIntervalMs;
+    int _fd;
+    uint64_t _segment;      // id of the segment being appended to
+    uint64_t _oldestLive;   // oldest segment written by this process that is not yet released
+    vector<uint64_t> _recovered;
+
+    mutex _ioLock;          // owns the file: writes, syncs, rotation and release
+    mutex _bufLock;         // owns the in-memory buffer and the LSN counters
+    condition_variable _durableCond;
+    condition_variable _stopCond;
+    vector<char> _buffer;
+    uint64_t _appended;     // LSN of the last appended record
+    uint64_t _durable;      // every LSN up to here is fsynced
+    bool _syncing;
+    bool _stop;
+    thread _syncThread;
+
+    static uint32_t checksum(const Record &rec) {
+        uint32_t h;
+        MurmurHash3_x86_32(&rec, (int) offsetof(Record, check), 0x5eed, &h);
+        return h;
+    }
+
+    string segmentName(uint64_t id) {
+        return _dir + "/wal_" + to_string(id) + ".log";
+    }
+
+    vector<uint64_t> existingSegments() {
+        vector<uint64_t> ids;
+        DIR *d = opendir(_dir.c_str());
+        if (d == NULL) {
+            return ids;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL) {
+            unsigned long long id;
+            char tail;
+            if (sscanf(entry->d_name, "wal_%llu.lo%c", &id, &tail) == 2 && tail == 'g') {
+                ids.push_back(id);
+            }
+        }
+        closedir(d);
+        sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    void openSegment(uint64_t id) {
+        _fd = open(segmentName(id).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, (mode_t) 0600);
+        if (_fd == -1) {
+            perror("Error opening log segment");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // caller holds _ioLock
+    void writeBuffered(bool sync) {
+        vector<char> out;
+        uint64_t upTo;
+        {
+            lock_guard<mutex> l(_bufLock);
+            out.swap(_buffer);
+            upTo = _appended;
+        }
+        size_t done = 0;
+        while (done < out.size()) {
+            ssize_t w = write(_fd, &out[done], out.size() - done);
+            if (w == -1) {
+                if (errno == EINTR) continue;
+                perror("Error writing log segment");
+                exit(EXIT_FAILURE);
+            }
+            done += w;
+        }
+        if (sync) {
+            if (fdatasync(_fd) == -1) {
+                perror("Error syncing log segment");
+                exit(EXIT_FAILURE);
+            }
+            lock_guard<mutex> l(_bufLock);
+            if (upTo > _durable) {
+                _durable = upTo;
+            }
+            _durableCond.notify_all();
+        }
+    }
+
+    // group commit: the first waiter becomes the leader and syncs everything
+    // appended so far; whoever arrived meanwhile rides along on the next sync
+    void waitDurable(uint64_t lsn) {
+        unique_lock<mutex> l(_bufLock);
+        while (_durable < lsn) {
+            if (!_syncing) {
+                _syncing = true;
+                l.unlock();
+                flush(true);
+                l.lock();
+                _syncing = false;
+                _durableCond.notify_all();
+            }
+            else {
+                _durableCond.wait(l);
+            }
+        }
+    }
+
+    void syncLoop() {
+        unique_lock<mutex> l(_bufLock);
+        while (!_stop) {
+            _stopCond.wait_for(l, chrono::milliseconds(_syncIntervalMs));
+            if (_stop) {
+                break;
+            }
+            l.unlock();
+            flush(true);
+            l.lock();
+        }
+    }
+};
+
+#endif /* wal_h */